@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "allocsites.h"
+#include "vm.h"
+
+/* Objects of one type allocated at one place in the source:
+         - "name" is the name of the function ("script" for the top level,
+   NULL for an empty entry) and "line" the line within it, or 0 for objects
+   made outside "run()" (e.g. while compiling)
+         - "bytes" and "objects" are the estimated totals, "samples" how many
+   samples they were estimated from
+ */
+typedef struct {
+  char *name;
+  int line;
+  ObjType type;
+  double bytes;
+  double objects;
+  uint64_t samples;
+} AllocSite;
+
+bool allocSitesEnabled = false;
+size_t allocSiteBytes = 0;
+size_t allocSiteNext = SIZE_MAX;
+
+static const char *reportPath = NULL;
+static size_t sampleRate = 1;
+static uint64_t randomState = 0x9e3779b97f4a7c15u;
+
+// Open addressing hash table of every site seen so far
+static AllocSite *sites = NULL;
+static int siteCount = 0;
+static int siteCapacity = 0;
+
+static const char *typeNames[] = {
+    [OBJ_CLOSURE] = "closure", [OBJ_FUNCTION] = "function",
+    [OBJ_NATIVE] = "native",   [OBJ_STRING] = "string",
+    [OBJ_UPVALUE] = "upvalue",
+};
+
+// Bytes until the next sample: uniform between 1 and twice the rate, so that
+// on average one sample is taken every "sampleRate" bytes without falling
+// into step with a loop that allocates the same objects over and over
+static size_t nextInterval() {
+  if (sampleRate == 1)
+    return 1;
+  // xorshift64
+  randomState ^= randomState << 13;
+  randomState ^= randomState >> 7;
+  randomState ^= randomState << 17;
+  return 1 + randomState % (2 * sampleRate - 1);
+}
+
+// FNV-1a, like "hashString" in "object.c", mixed with the line and type
+static uint32_t hashSite(const char *name, int line, ObjType type) {
+  uint32_t hash = 2166136261u;
+  for (; *name != '\0'; name++) {
+    hash ^= (uint8_t)*name;
+    hash *= 16777619;
+  }
+  hash ^= (uint32_t)line * 31 + (uint32_t)type;
+  hash *= 16777619;
+  return hash;
+}
+
+static AllocSite *findSite(AllocSite *entries, int capacity, const char *name,
+                           int line, ObjType type) {
+  uint32_t index = hashSite(name, line, type) % capacity;
+  for (;;) {
+    AllocSite *entry = &entries[index];
+    if (entry->name == NULL ||
+        (entry->line == line && entry->type == type &&
+         strcmp(entry->name, name) == 0))
+      return entry;
+    index = (index + 1) % capacity;
+  }
+}
+
+static void growSites() {
+  int capacity = siteCapacity < 64 ? 64 : siteCapacity * 2;
+  AllocSite *entries = calloc(capacity, sizeof(AllocSite));
+  if (entries == NULL)
+    exit(1);
+  for (int i = 0; i < siteCapacity; i++) {
+    AllocSite *site = &sites[i];
+    if (site->name == NULL)
+      continue;
+    *findSite(entries, capacity, site->name, site->line, site->type) = *site;
+  }
+  free(sites);
+  sites = entries;
+  siteCapacity = capacity;
+}
+
+void recordAllocationSite(ObjType type, size_t size) {
+  const char *name = "(outside run)";
+  int line = 0;
+  if (vm.frameCount > 0) {
+    CallFrame *frame = &vm.frames[vm.frameCount - 1];
+    ObjFunction *function = frame->closure->function;
+    name = function->name != NULL ? function->name->chars : "script";
+    // "ip" has moved past the instruction that is executing
+    size_t instruction = frame->ip - function->chunk.code - 1;
+    line = function->chunk.lines[instruction];
+  }
+
+  if (siteCount + 1 > siteCapacity * 3 / 4)
+    growSites();
+  AllocSite *site = findSite(sites, siteCapacity, name, line, type);
+  if (site->name == NULL) {
+    site->name = strdup(name);
+    if (site->name == NULL)
+      exit(1);
+    site->line = line;
+    site->type = type;
+    siteCount++;
+  }
+
+  // The sample stands for every byte since the previous one
+  site->bytes += allocSiteBytes;
+  site->objects += (double)allocSiteBytes / size;
+  site->samples++;
+  allocSiteBytes = 0;
+  allocSiteNext = nextInterval();
+}
+
+static int compareSites(const void *a, const void *b) {
+  double left = (*(AllocSite *const *)a)->bytes;
+  double right = (*(AllocSite *const *)b)->bytes;
+  return (left < right) - (left > right);
+}
+
+static void writeReport() {
+  FILE *out = stderr;
+  if (reportPath != NULL) {
+    out = fopen(reportPath, "w");
+    if (out == NULL) {
+      fprintf(stderr, "Couldn't open allocation site report \"%s\"\n",
+              reportPath);
+      return;
+    }
+  }
+
+  AllocSite **sorted = malloc(sizeof(AllocSite *) * (siteCount + 1));
+  if (sorted == NULL)
+    exit(1);
+  int count = 0;
+  double totalBytes = 0;
+  double totalObjects = 0;
+  for (int i = 0; i < siteCapacity; i++) {
+    if (sites[i].name == NULL)
+      continue;
+    sorted[count++] = &sites[i];
+    totalBytes += sites[i].bytes;
+    totalObjects += sites[i].objects;
+  }
+  qsort(sorted, count, sizeof(AllocSite *), compareSites);
+
+  if (sampleRate == 1)
+    fprintf(out, "=== allocation sites (every allocation) ===\n");
+  else
+    fprintf(out, "=== allocation sites (sampled every ~%zu bytes) ===\n",
+            sampleRate);
+  fprintf(out, "%14s %12s %7s %10s %10s  %s\n", "bytes", "objects", "share",
+          "samples", "type", "site");
+  for (int i = 0; i < count; i++) {
+    AllocSite *site = sorted[i];
+    fprintf(out, "%14.0f %12.0f %6.2f%% %10llu %10s  ", site->bytes,
+            site->objects,
+            totalBytes > 0 ? site->bytes * 100 / totalBytes : 0.0,
+            (unsigned long long)site->samples, typeNames[site->type]);
+    if (site->line > 0)
+      fprintf(out, "%s:%d\n", site->name, site->line);
+    else
+      fprintf(out, "%s\n", site->name);
+  }
+  fprintf(out, "%14.0f %12.0f %7s %10s %10s  total\n", totalBytes,
+          totalObjects, "", "", "");
+
+  free(sorted);
+  if (out != stderr)
+    fclose(out);
+}
+
+bool enableAllocSites(const char *path, size_t rate) {
+  if (rate == 0)
+    return false;
+  if (!allocSitesEnabled)
+    atexit(writeReport);
+  allocSitesEnabled = true;
+  reportPath = path;
+  sampleRate = rate;
+  allocSiteBytes = 0;
+  allocSiteNext = nextInterval();
+  return true;
+}
@@ -0,0 +1,33 @@
+#ifndef clox_allocsites_h
+#define clox_allocsites_h
+
+#include "common.h"
+#include "object.h"
+
+// Whether object allocations are being attributed to the Lox source lines
+// that make them
+extern bool allocSitesEnabled;
+
+// Bytes allocated since the last sample, and how many bytes to allocate before
+// taking the next one
+extern size_t allocSiteBytes;
+extern size_t allocSiteNext;
+
+// Start sampling allocations about once every "rate" bytes (1 records every
+// allocation) and write the report to "path" (or to stderr if "path" is NULL)
+// when the interpreter exits. Returns false if "rate" is 0
+bool enableAllocSites(const char *path, size_t rate);
+
+// Charge every byte allocated since the previous sample to the function and
+// line that is executing, as a "type" object of "size" bytes
+void recordAllocationSite(ObjType type, size_t size);
+
+// Count a new object of "type" that uses "size" bytes, taking a sample once
+// enough bytes have been allocated
+static inline void countAllocationSite(ObjType type, size_t size) {
+  allocSiteBytes += size;
+  if (allocSiteBytes >= allocSiteNext)
+    recordAllocationSite(type, size);
+}
+
+#endif
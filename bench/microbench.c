@@ -0,0 +1,347 @@
+/* Microbenchmarks for the interpreter's hot C paths
+ *
+ * Drives "table.c", "scanner.c" and the object allocator directly with
+ * synthetic workloads and reports the time and the number of allocations per
+ * operation, i.e. calls into the system allocator and into the object heap.
+ * Build it from the repository root together with every interpreter source
+ * except "main.c":
+ *
+ *   gcc -O2 -I. bench/microbench.c $(ls *.c | grep -v main.c) \
+ *       -Wl,--wrap=realloc,--wrap=heapAllocate -o microbench
+ *
+ * "--wrap" routes the interpreter's realloc and heapAllocate calls through the
+ * counting wrappers below. Usage: ./microbench [-s scale] [benchmark...]
+ *
+ * Note that the numbers are only meaningful in a build without
+ * DEBUG_STRESS_GC and DEBUG_LOG_GC.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+#include "memory.h"
+#include "object.h"
+#include "scanner.h"
+#include "table.h"
+#include "vm.h"
+
+// Allocation counter, updated by the "--wrap" wrappers. Objects come from
+// "heapAllocate()", everything else (tables, arrays, the gray stack) from
+// "realloc()"
+
+static size_t allocCalls = 0;
+
+void *__real_realloc(void *pointer, size_t size);
+void *__real_heapAllocate(size_t size);
+
+void *__wrap_realloc(void *pointer, size_t size) {
+  allocCalls++;
+  return __real_realloc(pointer, size);
+}
+
+void *__wrap_heapAllocate(size_t size) {
+  allocCalls++;
+  return __real_heapAllocate(size);
+}
+
+/* Result of timing one benchmark:
+   - "ops" is the number of operations performed
+   - "nanos" is the total wall time taken by those operations
+   - "allocs" is the number of realloc and heapAllocate calls made during the
+   timed region
+ */
+typedef struct {
+  size_t ops;
+  double nanos;
+  size_t allocs;
+} Result;
+
+static double scale = 1.0;
+
+static double nowNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+// Number of operations for a benchmark with "base" operations at scale 1
+static size_t scaled(size_t base) {
+  size_t count = (size_t)(base * scale);
+  return count < 1 ? 1 : count;
+}
+
+// Start and stop the clock and allocation counter around a timed region
+#define BEGIN_TIMING()                                                         \
+  size_t allocsBefore = allocCalls;                                          \
+  double start = nowNanos()
+#define END_TIMING(opCount)                                                    \
+  ((Result){(opCount), nowNanos() - start, allocCalls - allocsBefore})
+
+// Keep "string" alive across collections by storing it in "vm.globals"
+static void root(ObjString *string) {
+  push(OBJ_VAL(string));
+  tableSet(&vm.globals, string, BOOL_VAL(true));
+  pop();
+}
+
+// FNV-1a, identical to "hashString" in "object.c"
+static uint32_t hashKey(const char *key, int length) {
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < length; i++) {
+    hash ^= (uint8_t)key[i];
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+// Interned, rooted keys "key0", "key1", ... shared by the table benchmarks
+static ObjString **keys = NULL;
+static size_t keyCount = 0;
+
+static void makeKeys(size_t count) {
+  if (keyCount >= count)
+    return;
+  keys = (ObjString **)__real_realloc(keys, sizeof(ObjString *) * count);
+  char buffer[32];
+  for (size_t i = keyCount; i < count; i++) {
+    int length = snprintf(buffer, sizeof(buffer), "key%zu", i);
+    keys[i] = copyString(buffer, length);
+    root(keys[i]);
+  }
+  keyCount = count;
+}
+
+// Intern fresh strings: hash, miss in "tableFindString", allocate, "tableSet"
+static Result benchInternMiss() {
+  size_t count = scaled(200000);
+  char buffer[32];
+  BEGIN_TIMING();
+  for (size_t i = 0; i < count; i++) {
+    int length = snprintf(buffer, sizeof(buffer), "miss%zu", i);
+    copyString(buffer, length);
+  }
+  return END_TIMING(count);
+}
+
+// Intern strings that already exist: hash and hit in "tableFindString"
+static Result benchInternHit() {
+  size_t count = scaled(1000000);
+  makeKeys(scaled(100000));
+  int lengths[1024];
+  char texts[1024][32];
+  for (int i = 0; i < 1024; i++)
+    lengths[i] = snprintf(texts[i], sizeof(texts[i]), "key%zu",
+                          (size_t)i * 97 % keyCount);
+  BEGIN_TIMING();
+  for (size_t i = 0; i < count; i++)
+    copyString(texts[i & 1023], lengths[i & 1023]);
+  return END_TIMING(count);
+}
+
+// Insert every key into a fresh table, growing it from empty
+static Result benchTableSet() {
+  makeKeys(scaled(100000));
+  Table table;
+  initTable(&table);
+  BEGIN_TIMING();
+  for (size_t i = 0; i < keyCount; i++)
+    tableSet(&table, keys[i], NUMBER_VAL((double)i));
+  Result result = END_TIMING(keyCount);
+  freeTable(&table);
+  return result;
+}
+
+// Look keys up in a populated table ("findEntry" hits)
+static Result benchTableGet() {
+  makeKeys(scaled(100000));
+  Table table;
+  initTable(&table);
+  for (size_t i = 0; i < keyCount; i++)
+    tableSet(&table, keys[i], NUMBER_VAL((double)i));
+
+  size_t count = scaled(2000000);
+  double sum = 0;
+  Value value;
+  BEGIN_TIMING();
+  for (size_t i = 0; i < count; i++) {
+    if (tableGet(&table, keys[(i * 7919) % keyCount], &value))
+      sum += AS_NUMBER(value);
+  }
+  Result result = END_TIMING(count);
+  freeTable(&table);
+  if (sum < 0)
+    printf("unreachable\n");
+  return result;
+}
+
+// Insert and look up keys whose hashes all share their low 12 bits, so they
+// land in the same bucket for every capacity up to 4096 and probe linearly
+static Result benchTableCollide() {
+  size_t wanted = scaled(1500);
+  ObjString **colliding =
+      (ObjString **)__real_realloc(NULL, sizeof(ObjString *) * wanted);
+  char buffer[32];
+  size_t found = 0;
+  for (size_t i = 0; found < wanted; i++) {
+    int length = snprintf(buffer, sizeof(buffer), "collide%zu", i);
+    if ((hashKey(buffer, length) & 0xfff) != 0)
+      continue;
+    colliding[found] = copyString(buffer, length);
+    root(colliding[found]);
+    found++;
+  }
+
+  Table table;
+  initTable(&table);
+  Value value;
+  BEGIN_TIMING();
+  for (size_t i = 0; i < found; i++)
+    tableSet(&table, colliding[i], NIL_VAL);
+  for (size_t i = 0; i < found; i++)
+    tableGet(&table, colliding[i], &value);
+  Result result = END_TIMING(found * 2);
+  freeTable(&table);
+  free(colliding);
+  return result;
+}
+
+// Scan a large generated source file from start to finish
+static Result benchScanner() {
+  static const char *snippet =
+      "fun fib(n) {\n"
+      "  if (n < 2) return n; // base case\n"
+      "  return fib(n - 2) + fib(n - 1);\n"
+      "}\n"
+      "var greeting = \"hello\" + \" \" + \"world\";\n"
+      "for (var i = 0; i <= 10.5; i = i + 1) print i != nil and !false;\n";
+  size_t snippetLength = strlen(snippet);
+  size_t repeats = scaled(20000);
+  char *source = (char *)__real_realloc(NULL, snippetLength * repeats + 1);
+  for (size_t i = 0; i < repeats; i++)
+    memcpy(source + i * snippetLength, snippet, snippetLength);
+  source[snippetLength * repeats] = '\0';
+
+  size_t tokens = 0;
+  initScanner(source);
+  BEGIN_TIMING();
+  for (;;) {
+    Token token = scanToken();
+    tokens++;
+    if (token.type == TOKEN_EOF)
+      break;
+  }
+  Result result = END_TIMING(tokens);
+  free(source);
+  return result;
+}
+
+// Allocate many tiny unreachable objects and collect them again
+static Result benchObjectChurn() {
+  size_t count = scaled(1000000);
+  Value slot = NIL_VAL;
+  BEGIN_TIMING();
+  for (size_t i = 0; i < count; i++) {
+    newUpvalue(&slot);
+    if ((i & 0xffff) == 0xffff)
+      collectGarbage();
+  }
+  collectGarbage();
+  return END_TIMING(count);
+}
+
+// Raw "reallocate" traffic: grow a small array step by step, then free it
+static Result benchReallocate() {
+  size_t count = scaled(200000);
+  BEGIN_TIMING();
+  for (size_t i = 0; i < count; i++) {
+    int capacity = 0;
+    Value *values = NULL;
+    for (int step = 0; step < 4; step++) {
+      int oldCapacity = capacity;
+      capacity = GROW_CAPACITY(oldCapacity);
+      values = GROW_ARRAY(Value, values, oldCapacity, capacity);
+    }
+    FREE_ARRAY(Value, values, capacity);
+  }
+  return END_TIMING(count);
+}
+
+// Concatenate two strings into a fresh string and hand it to "takeString"
+static Result benchTakeString() {
+  size_t count = scaled(500000);
+  ObjString *left = copyString("left-", 5);
+  root(left);
+  char suffix[32];
+  BEGIN_TIMING();
+  for (size_t i = 0; i < count; i++) {
+    // Half of the suffixes repeat, so roughly half of the strings are
+    // interned hits that free the new string again
+    int suffixLength =
+        snprintf(suffix, sizeof(suffix), "%zu", (i & 1) ? i : i & 0xff);
+    int length = left->length + suffixLength;
+    ObjString *string = allocateString(length);
+    memcpy(string->chars, left->chars, left->length);
+    memcpy(string->chars + left->length, suffix, suffixLength);
+    takeString(string);
+  }
+  return END_TIMING(count);
+}
+
+typedef struct {
+  const char *name;
+  Result (*run)();
+} Benchmark;
+
+static Benchmark benchmarks[] = {
+    {"intern-miss", benchInternMiss},
+    {"intern-hit", benchInternHit},
+    {"table-set", benchTableSet},
+    {"table-get", benchTableGet},
+    {"table-collide", benchTableCollide},
+    {"scanner", benchScanner},
+    {"object-churn", benchObjectChurn},
+    {"reallocate", benchReallocate},
+    {"take-string", benchTakeString},
+};
+
+#define BENCHMARK_COUNT (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+static bool selected(const char *name, int argc, const char *argv[],
+                     int first) {
+  if (first >= argc)
+    return true;
+  for (int i = first; i < argc; i++)
+    if (strcmp(argv[i], name) == 0)
+      return true;
+  return false;
+}
+
+int main(int argc, const char *argv[]) {
+  int first = 1;
+  if (argc > 2 && strcmp(argv[1], "-s") == 0) {
+    scale = atof(argv[2]);
+    if (scale <= 0) {
+      fprintf(stderr, "Usage: microbench [-s scale] [benchmark...]\n");
+      return 64;
+    }
+    first = 3;
+  }
+
+  initVM();
+
+  printf("%-16s %12s %12s %12s\n", "benchmark", "ops", "ns/op", "allocs/op");
+  for (size_t i = 0; i < BENCHMARK_COUNT; i++) {
+    if (!selected(benchmarks[i].name, argc, argv, first))
+      continue;
+    Result result = benchmarks[i].run();
+    printf("%-16s %12zu %12.1f %12.3f\n", benchmarks[i].name, result.ops,
+           result.nanos / result.ops, (double)result.allocs / result.ops);
+  }
+
+  freeVM();
+  free(keys);
+  return 0;
+}
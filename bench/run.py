@@ -0,0 +1,219 @@
+#!/usr/bin/env python3
+"""Run the Lox benchmark suite under a clox binary and report the results.
+
+Every benchmark is executed N times (after optional warmup runs). For each one
+the runner records the median and 95th percentile wall time plus the peak
+resident set size of the interpreter process (read just before it exits, which
+needs Linux and ptrace), and writes them out as JSON or
+CSV so that two interpreter builds can be compared objectively:
+
+    python3 bench/run.py --clox ./clox -n 10 --format json -o before.json
+"""
+
+import argparse
+import csv
+import ctypes
+import datetime
+import json
+import math
+import os
+import signal
+import statistics
+import subprocess
+import sys
+import threading
+import time
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+
+
+def percentile(samples, fraction):
+    """Nearest-rank percentile of a non-empty list of samples."""
+    ordered = sorted(samples)
+    rank = max(1, math.ceil(len(ordered) * fraction))
+    return ordered[rank - 1]
+
+
+# Linux lets a parent stop its child just before it exits, while its memory
+# is still mapped, which is the only time the peak RSS of that process alone
+# can be read. ru_maxrss can't be used for this: a child inherits the peak of
+# the process it was forked from, i.e. this Python interpreter, across exec,
+# and its /proc entry has no memory figures left once it has exited
+PTRACE_TRACEME = 0
+PTRACE_CONT = 7
+PTRACE_SETOPTIONS = 0x4200
+PTRACE_O_TRACEEXIT = 0x40
+PTRACE_O_EXITKILL = 0x100000
+PTRACE_EVENT_EXIT = 6
+
+libc = None
+if sys.platform.startswith("linux"):
+    try:
+        libc = ctypes.CDLL(None, use_errno=True)
+        libc.ptrace.argtypes = [ctypes.c_long, ctypes.c_long, ctypes.c_void_p,
+                                ctypes.c_void_p]
+        libc.ptrace.restype = ctypes.c_long
+    except (OSError, AttributeError):
+        libc = None
+
+
+def ptrace(request, pid=0, data=0):
+    return libc.ptrace(request, pid, None, ctypes.c_void_p(data))
+
+
+def peak_rss_kib(pid):
+    """VmHWM of a live (or stopped) process, in KiB, or None."""
+    try:
+        with open("/proc/%d/status" % pid) as status:
+            for line in status:
+                if line.startswith("VmHWM:"):
+                    return int(line.split()[1])
+    except OSError:
+        pass
+    return None
+
+
+def run_once(clox, script):
+    """Run "script" once and return (wall seconds, peak RSS in KiB, status,
+    stderr)."""
+    traced = libc is not None
+    start = time.perf_counter()
+    process = subprocess.Popen(
+        [clox, script], stdout=subprocess.DEVNULL, stderr=subprocess.PIPE,
+        preexec_fn=(lambda: ptrace(PTRACE_TRACEME)) if traced else None)
+
+    # Read stderr while the child runs, or it blocks once the pipe is full
+    # (e.g. with debug output switched on through CLOX_DEBUG)
+    chunks = []
+    reader = threading.Thread(
+        target=lambda: chunks.append(process.stderr.read()))
+    reader.start()
+
+    peak = None
+    exec_stopped = False
+    while True:
+        # wait4 gives the resource usage of this child alone, unlike
+        # getrusage(RUSAGE_CHILDREN) which accumulates over every child
+        _, status, usage = os.wait4(process.pid, 0)
+        if not os.WIFSTOPPED(status):
+            break
+        signal_number = os.WSTOPSIG(status)
+        if status >> 16 == PTRACE_EVENT_EXIT:
+            peak = peak_rss_kib(process.pid)
+            signal_number = 0
+        elif signal_number == signal.SIGTRAP and not exec_stopped:
+            # Stopped by the exec that started tracing
+            exec_stopped = True
+            ptrace(PTRACE_SETOPTIONS, process.pid,
+                   PTRACE_O_TRACEEXIT | PTRACE_O_EXITKILL)
+            signal_number = 0
+        # Any other signal is passed on to the child
+        ptrace(PTRACE_CONT, process.pid, signal_number)
+    elapsed = time.perf_counter() - start
+    process.returncode = os.waitstatus_to_exitcode(status)
+
+    reader.join()
+    process.stderr.close()
+    if peak is None:
+        # Not traced (or ptrace refused): only an upper bound, see above
+        peak = usage.ru_maxrss
+    stderr = b"".join(chunks).decode(errors="replace")
+    return elapsed, peak, process.returncode, stderr
+
+
+def run_benchmark(clox, script, runs, warmup):
+    for _ in range(warmup):
+        run_once(clox, script)
+
+    times = []
+    peak_rss = 0
+    for _ in range(runs):
+        elapsed, rss, code, stderr = run_once(clox, script)
+        if code != 0:
+            sys.stderr.write("%s exited with status %d\n%s" %
+                             (script, code, stderr))
+            return None
+        times.append(elapsed)
+        peak_rss = max(peak_rss, rss)
+
+    return {
+        "benchmark": os.path.splitext(os.path.basename(script))[0],
+        "runs": runs,
+        "median_s": statistics.median(times),
+        "p95_s": percentile(times, 0.95),
+        "min_s": min(times),
+        "max_s": max(times),
+        "stdev_s": statistics.stdev(times) if runs > 1 else 0.0,
+        "peak_rss_kib": peak_rss,
+    }
+
+
+def write_json(results, meta, out):
+    json.dump({"meta": meta, "results": results}, out, indent=2)
+    out.write("\n")
+
+
+def write_csv(results, meta, out):
+    fields = ["benchmark", "runs", "median_s", "p95_s", "min_s", "max_s",
+              "stdev_s", "peak_rss_kib"]
+    writer = csv.DictWriter(out, fieldnames=fields)
+    writer.writeheader()
+    for result in results:
+        writer.writerow(result)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("benchmarks", nargs="*",
+                        help="benchmark scripts (default: every bench/*.lox)")
+    parser.add_argument("--clox", default="./clox",
+                        help="interpreter binary to run (default: ./clox)")
+    parser.add_argument("-n", "--runs", type=int, default=5,
+                        help="timed runs per benchmark (default: 5)")
+    parser.add_argument("-w", "--warmup", type=int, default=1,
+                        help="untimed warmup runs per benchmark (default: 1)")
+    parser.add_argument("-f", "--format", choices=["json", "csv"],
+                        default="json", help="output format (default: json)")
+    parser.add_argument("-o", "--output",
+                        help="write results to this file instead of stdout")
+    args = parser.parse_args()
+
+    if args.runs < 1:
+        parser.error("--runs must be at least 1")
+
+    scripts = args.benchmarks or sorted(
+        os.path.join(BENCH_DIR, name) for name in os.listdir(BENCH_DIR)
+        if name.endswith(".lox"))
+
+    results = []
+    failed = False
+    for script in scripts:
+        sys.stderr.write("running %s\n" % script)
+        result = run_benchmark(args.clox, script, args.runs, args.warmup)
+        if result is None:
+            failed = True
+        else:
+            results.append(result)
+
+    meta = {
+        "clox": os.path.abspath(args.clox),
+        "date": datetime.datetime.now().isoformat(timespec="seconds"),
+        "runs": args.runs,
+        "warmup": args.warmup,
+    }
+
+    out = open(args.output, "w", newline="") if args.output else sys.stdout
+    try:
+        if args.format == "json":
+            write_json(results, meta, out)
+        else:
+            write_csv(results, meta, out)
+    finally:
+        if args.output:
+            out.close()
+
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
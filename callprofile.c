@@ -0,0 +1,313 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "callprofile.h"
+#include "timer.h"
+#include "vm.h"
+
+// The profile ids live in the objects themselves, which only have room for
+// them in builds with the profiling hooks
+#ifdef PROFILE_CALLS
+
+/* Cost of every call from one function to another
+         - "callee" is the profile id of the function being called
+         - "line" is the line of the first call seen from the caller
+         - "calls" is how many times the caller called "callee"
+         - "nanos" and "bytes" are the inclusive cost of those calls
+ */
+typedef struct {
+  int callee;
+  int line;
+  uint64_t calls;
+  uint64_t nanos;
+  uint64_t bytes;
+} CallEdge;
+
+/* Everything recorded about one Lox function or native
+         - "name" is a copy of the function's name (it may be freed later)
+         - "line" is the line the function's code starts on
+         - "calls" is how many times it was called
+         - "selfNanos"/"selfBytes" is the cost excluding callees
+         - "totalNanos"/"totalBytes" is the cost including callees, counting
+   only the outermost activation of recursive functions
+         - "active" is the number of activations currently on the stack
+         - "edges" are the calls it made to other functions
+ */
+typedef struct {
+  char *name;
+  int line;
+  bool isNative;
+  uint64_t calls;
+  uint64_t selfNanos;
+  uint64_t selfBytes;
+  uint64_t totalNanos;
+  uint64_t totalBytes;
+  int active;
+  CallEdge *edges;
+  int edgeCount;
+  int edgeCapacity;
+} FunctionProfile;
+
+/* An activation on the profiler's shadow stack
+         - "function" is the profile id of the function that was called
+         - "line" is the line of the call in the caller
+         - "start"/"startBytes" are the clock and allocation counter at entry
+         - "childNanos"/"childBytes" is the inclusive cost of its callees
+ */
+typedef struct {
+  int function;
+  int line;
+  uint64_t start;
+  uint64_t startBytes;
+  uint64_t childNanos;
+  uint64_t childBytes;
+} Activation;
+
+bool callProfilingEnabled = false;
+
+static const char *outputPath = NULL;
+static const char *sourcePath = NULL;
+
+static FunctionProfile *functions = NULL;
+static int functionCount = 0;
+static int functionCapacity = 0;
+
+// Natives and the script can be called from the top level as well as from
+// inside frames, so the shadow stack is deeper than "vm.frames"
+static Activation stack[FRAMES_MAX + 1];
+static int stackDepth = 0;
+
+// Total number of bytes allocated since profiling started
+static uint64_t allocatedBytes = 0;
+
+// Register a new function and return its profile id, or -1 if out of memory
+static int addFunction(const char *name, int line, bool isNative) {
+  if (functionCount == functionCapacity) {
+    int capacity = functionCapacity < 16 ? 16 : functionCapacity * 2;
+    FunctionProfile *grown = (FunctionProfile *)realloc(
+        functions, sizeof(FunctionProfile) * capacity);
+    if (grown == NULL)
+      return -1;
+    functions = grown;
+    functionCapacity = capacity;
+  }
+
+  FunctionProfile *function = &functions[functionCount];
+  memset(function, 0, sizeof(FunctionProfile));
+  function->name = strdup(name);
+  if (function->name == NULL)
+    return -1;
+  function->line = line;
+  function->isNative = isNative;
+  return functionCount++;
+}
+
+// Line currently executing in frame "index" of "vm.frames"
+static int frameLine(int index) {
+  if (index < 0)
+    return 0;
+  CallFrame *frame = &vm.frames[index];
+  Chunk *chunk = &frame->closure->function->chunk;
+  int instruction = (int)(frame->ip - chunk->code) - 1;
+  return chunk->lines[instruction < 0 ? 0 : instruction];
+}
+
+static void enter(int id, int line) {
+  if (id < 0 || stackDepth == FRAMES_MAX + 1)
+    return;
+
+  functions[id].calls++;
+  functions[id].active++;
+
+  Activation *activation = &stack[stackDepth++];
+  activation->function = id;
+  activation->line = line;
+  activation->startBytes = allocatedBytes;
+  activation->childNanos = 0;
+  activation->childBytes = 0;
+  // Read the clock last so the profiler's own work is not charged
+  activation->start = monotonicNanos();
+}
+
+void profileEnterFunction(ObjFunction *function) {
+  if (function->profileId < 0) {
+    const char *name = function->name != NULL ? function->name->chars
+                                               : "script";
+    function->profileId =
+        addFunction(name, function->chunk.count > 0 ? function->chunk.lines[0]
+                                                    : 0,
+                    false);
+  }
+
+  // The new frame is already on "vm.frames", so the caller is the one below
+  enter(function->profileId, frameLine(vm.frameCount - 2));
+}
+
+void profileEnterNative(ObjNative *native) {
+  if (native->profileId < 0)
+    native->profileId = addFunction(native->name, 0, true);
+
+  enter(native->profileId, frameLine(vm.frameCount - 1));
+}
+
+// Find (or add) the edge from "caller" to "callee"
+static CallEdge *findEdge(FunctionProfile *caller, int callee, int line) {
+  for (int i = 0; i < caller->edgeCount; i++) {
+    if (caller->edges[i].callee == callee)
+      return &caller->edges[i];
+  }
+
+  if (caller->edgeCount == caller->edgeCapacity) {
+    int capacity = caller->edgeCapacity < 4 ? 4 : caller->edgeCapacity * 2;
+    CallEdge *grown =
+        (CallEdge *)realloc(caller->edges, sizeof(CallEdge) * capacity);
+    if (grown == NULL)
+      return NULL;
+    caller->edges = grown;
+    caller->edgeCapacity = capacity;
+  }
+
+  CallEdge *edge = &caller->edges[caller->edgeCount++];
+  memset(edge, 0, sizeof(CallEdge));
+  edge->callee = callee;
+  edge->line = line;
+  return edge;
+}
+
+void profileReturn() {
+  uint64_t now = monotonicNanos();
+  if (stackDepth == 0)
+    return;
+
+  Activation *activation = &stack[--stackDepth];
+  FunctionProfile *function = &functions[activation->function];
+  uint64_t nanos = now - activation->start;
+  uint64_t bytes = allocatedBytes - activation->startBytes;
+
+  function->selfNanos += nanos - activation->childNanos;
+  function->selfBytes += bytes - activation->childBytes;
+  // Recursive activations are already covered by the outermost one
+  if (--function->active == 0) {
+    function->totalNanos += nanos;
+    function->totalBytes += bytes;
+  }
+
+  if (stackDepth > 0) {
+    Activation *caller = &stack[stackDepth - 1];
+    caller->childNanos += nanos;
+    caller->childBytes += bytes;
+
+    CallEdge *edge = findEdge(&functions[caller->function],
+                              activation->function, activation->line);
+    if (edge != NULL) {
+      edge->calls++;
+      edge->nanos += nanos;
+      edge->bytes += bytes;
+    }
+  }
+}
+
+void profileAllocation(size_t bytes) { allocatedBytes += bytes; }
+
+void profileUnwind() {
+  while (stackDepth > 0)
+    profileReturn();
+}
+
+static const char *functionFile(FunctionProfile *function) {
+  return function->isNative ? "<native>" : sourcePath;
+}
+
+// Write the profile in the callgrind format understood by KCachegrind and
+// callgrind_annotate, with wall time in nanoseconds and bytes allocated as
+// the two events
+static void writeProfile() {
+  profileUnwind();
+
+  FILE *out = fopen(outputPath, "w");
+  if (out == NULL) {
+    fprintf(stderr, "Couldn't open call profile output \"%s\"\n", outputPath);
+    return;
+  }
+
+  uint64_t totalNanos = 0;
+  uint64_t totalBytes = 0;
+  for (int i = 0; i < functionCount; i++) {
+    totalNanos += functions[i].selfNanos;
+    totalBytes += functions[i].selfBytes;
+  }
+
+  fprintf(out, "# callgrind format\n");
+  fprintf(out, "version: 1\n");
+  fprintf(out, "creator: clox\n");
+  fprintf(out, "cmd: %s\n", sourcePath);
+  fprintf(out, "positions: line\n");
+  fprintf(out, "events: Nanoseconds Bytes\n");
+  fprintf(out, "summary: %llu %llu\n", (unsigned long long)totalNanos,
+          (unsigned long long)totalBytes);
+
+  // Callgrind derives inclusive costs from the call edges, but recursion makes
+  // those hard to read, so list them per function in comments as well
+  fprintf(out, "\n# %-24s %12s %16s %16s %16s %16s\n", "function", "calls",
+          "self ns", "total ns", "self bytes", "total bytes");
+  for (int i = 0; i < functionCount; i++) {
+    FunctionProfile *function = &functions[i];
+    fprintf(out, "# %-24s %12llu %16llu %16llu %16llu %16llu\n",
+            function->name, (unsigned long long)function->calls,
+            (unsigned long long)function->selfNanos,
+            (unsigned long long)function->totalNanos,
+            (unsigned long long)function->selfBytes,
+            (unsigned long long)function->totalBytes);
+  }
+  fprintf(out, "\n");
+
+  // Name compression: "(id) name" the first time, just "(id)" afterwards
+  bool *named = (bool *)calloc(functionCount + 1, sizeof(bool));
+  for (int i = 0; i < functionCount; i++) {
+    FunctionProfile *function = &functions[i];
+    fprintf(out, "fl=%s\n", functionFile(function));
+    if (named != NULL && named[i])
+      fprintf(out, "fn=(%d)\n", i + 1);
+    else
+      fprintf(out, "fn=(%d) %s\n", i + 1, function->name);
+    if (named != NULL)
+      named[i] = true;
+    fprintf(out, "%d %llu %llu\n", function->line,
+            (unsigned long long)function->selfNanos,
+            (unsigned long long)function->selfBytes);
+
+    for (int j = 0; j < function->edgeCount; j++) {
+      CallEdge *edge = &function->edges[j];
+      FunctionProfile *callee = &functions[edge->callee];
+      fprintf(out, "cfl=%s\n", functionFile(callee));
+      if (named != NULL && named[edge->callee])
+        fprintf(out, "cfn=(%d)\n", edge->callee + 1);
+      else
+        fprintf(out, "cfn=(%d) %s\n", edge->callee + 1, callee->name);
+      if (named != NULL)
+        named[edge->callee] = true;
+      fprintf(out, "calls=%llu %d\n", (unsigned long long)edge->calls,
+              callee->line);
+      fprintf(out, "%d %llu %llu\n", edge->line,
+              (unsigned long long)edge->nanos,
+              (unsigned long long)edge->bytes);
+    }
+    fprintf(out, "\n");
+  }
+  fprintf(out, "totals: %llu %llu\n", (unsigned long long)totalNanos,
+          (unsigned long long)totalBytes);
+
+  free(named);
+  fclose(out);
+}
+
+void enableCallProfiling(const char *path, const char *scriptPath) {
+  if (!callProfilingEnabled)
+    atexit(writeProfile);
+  callProfilingEnabled = true;
+  outputPath = path;
+  sourcePath = scriptPath;
+}
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef clox_callprofile_h
+#define clox_callprofile_h
+
+#include "common.h"
+#include "object.h"
+
+// Whether calls, returns and allocations are being recorded
+extern bool callProfilingEnabled;
+
+// Start recording every call and write the profile in callgrind format to
+// "path" when clox exits, with Lox functions attributed to "scriptPath"
+void enableCallProfiling(const char *path, const char *scriptPath);
+
+// Record a call to "function", whose frame has just been pushed
+void profileEnterFunction(ObjFunction *function);
+// Record a call to "native", made from the innermost frame
+void profileEnterNative(ObjNative *native);
+// Record a return from the innermost function or native being profiled
+void profileReturn();
+// Charge "bytes" of allocation to the innermost function being profiled
+void profileAllocation(size_t bytes);
+// Return from every function still being profiled (after a runtime error)
+void profileUnwind();
+
+#endif
@@ -5,11 +5,31 @@
 #include <stddef.h>
 #include <stdint.h>
 
+// Build with -DCLOX_DEBUG to compile in the debugging facilities below, each
+// of which is then switched on at runtime through "debugFlags" (see "debug.h").
+// Without it none of them are compiled into the interpreter at all
+#ifdef CLOX_DEBUG
 #define DEBUG_PRINT_CODE
 #define DEBUG_TRACE_EXECUTION
 
 #define DEBUG_STRESS_GC
 #define DEBUG_LOG_GC
+#endif
+
+// Build with -DCLOX_PROFILE to compile in the profiling hooks below, which are
+// then switched on at runtime from the command line. Without it the hooks cost
+// nothing because they are not in the interpreter at all
+#ifdef CLOX_PROFILE
+#define PROFILE_OPSTATS
+#define PROFILE_CALLS
+#define PROFILE_ALLOCSITES
+#endif
+
+// Build with -DCLOX_NAN_BOXING to pack every "Value" into the 8 bytes of a
+// double (see "value.h") instead of a 16 byte tagged union
+#ifdef CLOX_NAN_BOXING
+#define NAN_BOXING
+#endif
 
 #define UINT8_COUNT (UINT8_MAX + 1)
 
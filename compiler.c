@@ -6,6 +6,7 @@
 #include "compiler.h"
 #include "memory.h"
 #include "scanner.h"
+#include "timeline.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
@@ -257,6 +258,13 @@ static void initCompiler(Compiler *compiler, FunctionType type) {
     current->function->name =
         copyString(parser.previous.start, parser.previous.length);
 
+  // Scanning, parsing and emitting are interleaved in a single pass, so each
+  // function's compilation is one span
+  if (timelineEnabled)
+    timelineBegin("compile", type == TYPE_SCRIPT
+                                 ? "<script>"
+                                 : current->function->name->chars);
+
   Local *local = &current->locals[current->localCount++];
   local->depth = 0;
   local->isCaptured = false;
@@ -268,15 +276,26 @@ static ObjFunction *endCompiler() {
   emitReturn();
   ObjFunction *function = current->function;
 #ifdef DEBUG_PRINT_CODE
-  if (!parser.hadError)
+  if (debugFlags.printCode && !parser.hadError)
     disassembleChunk(currentChunk(), function->name != NULL
                                          ? function->name->chars
                                          : "<script>");
 #endif
+  if (timelineEnabled) {
+    char args[64];
+    snprintf(args, sizeof(args), "\"bytes\": %d, \"constants\": %d",
+             function->chunk.count, function->chunk.constants.count);
+    timelineEnd("compile",
+                function->name != NULL ? function->name->chars : "<script>",
+                args);
+  }
   // After the current function ends compilation,
   // you want the (previously) enclosing compiler to be the current one
 
   current = current->enclosing;
+  // Once it is no longer a compiler root, an old function still has to be
+  // remembered for the constants it was given since it became old
+  objectChanged((Obj *)function);
   return function;
 }
 
@@ -965,7 +984,9 @@ ObjFunction *compile(const char *source) {
 void markCompilerRoots() {
   Compiler *compiler = current;
   while (compiler != NULL) {
-    markObject((Obj *)compiler->function);
+    // Constants are still being added to the function, so it needs tracing
+    // again even if it is old or was traced earlier
+    rescanObject((Obj *)compiler->function);
     compiler = compiler->enclosing;
   }
 }
@@ -1,9 +1,88 @@
 #include <stdio.h>
+#include <string.h>
 
 #include "debug.h"
 #include "object.h"
 #include "value.h"
 
+DebugFlags debugFlags = {false, false, false, false};
+
+bool setDebugFlag(const char *name) {
+  if (strcmp(name, "print-code") == 0)
+    debugFlags.printCode = true;
+  else if (strcmp(name, "trace-execution") == 0)
+    debugFlags.traceExecution = true;
+  else if (strcmp(name, "stress-gc") == 0)
+    debugFlags.stressGC = true;
+  else if (strcmp(name, "log-gc") == 0)
+    debugFlags.logGC = true;
+  else
+    return false;
+
+  return true;
+}
+
+bool setDebugFlags(const char *names) {
+  bool known = true;
+  char name[32];
+
+  while (*names != '\0') {
+    // Copy the next comma separated name so it can be null terminated
+    size_t length = strcspn(names, ",");
+    if (length > 0 && length < sizeof(name)) {
+      memcpy(name, names, length);
+      name[length] = '\0';
+      known = setDebugFlag(name) && known;
+    } else if (length > 0)
+      known = false;
+
+    names += length;
+    if (*names == ',')
+      names++;
+  }
+
+  return known;
+}
+
+static const char *opcodeNames[] = {
+    [OP_CONSTANT] = "OP_CONSTANT",
+    [OP_NIL] = "OP_NIL",
+    [OP_TRUE] = "OP_TRUE",
+    [OP_FALSE] = "OP_FALSE",
+    [OP_POP] = "OP_POP",
+    [OP_GET_LOCAL] = "OP_GET_LOCAL",
+    [OP_SET_LOCAL] = "OP_SET_LOCAL",
+    [OP_GET_GLOBAL] = "OP_GET_GLOBAL",
+    [OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+    [OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+    [OP_GET_UPVALUE] = "OP_GET_UPVALUE",
+    [OP_SET_UPVALUE] = "OP_SET_UPVALUE",
+    [OP_EQUAL] = "OP_EQUAL",
+    [OP_GREATER] = "OP_GREATER",
+    [OP_LESS] = "OP_LESS",
+    [OP_ADD] = "OP_ADD",
+    [OP_SUBTRACT] = "OP_SUBTRACT",
+    [OP_MULTIPLY] = "OP_MULTIPLY",
+    [OP_DIVIDE] = "OP_DIVIDE",
+    [OP_NOT] = "OP_NOT",
+    [OP_NEGATE] = "OP_NEGATE",
+    [OP_PRINT] = "OP_PRINT",
+    [OP_JUMP] = "OP_JUMP",
+    [OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+    [OP_LOOP] = "OP_LOOP",
+    [OP_CALL] = "OP_CALL",
+    [OP_CLOSURE] = "OP_CLOSURE",
+    [OP_CLOSE_UPVALUE] = "OP_CLOSE_UPVALUE",
+    [OP_RETURN] = "OP_RETURN",
+};
+
+const char *opcodeName(uint8_t instruction) {
+  if (instruction >= sizeof(opcodeNames) / sizeof(opcodeNames[0]) ||
+      opcodeNames[instruction] == NULL)
+    return "OP_UNKNOWN";
+  return opcodeNames[instruction];
+}
+
 void disassembleChunk(Chunk *chunk, const char *name) {
   printf("=== %s ===\n", name);
 
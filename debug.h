@@ -2,6 +2,33 @@
 #define clox_debug_h
 
 #include "chunk.h"
+#include "common.h"
+
+/* Runtime switches for the facilities compiled in with CLOX_DEBUG:
+         - "printCode" disassembles every chunk after it is compiled
+         - "traceExecution" prints the stack and each instruction before it runs
+         - "stressGC" runs a collection on every allocation that grows (and a
+   compaction after every collection if compaction is on)
+         - "logGC" logs every allocation, mark, blacken and free
+ */
+typedef struct {
+  bool printCode;
+  bool traceExecution;
+  bool stressGC;
+  bool logGC;
+} DebugFlags;
+
+extern DebugFlags debugFlags;
+
+// Switch on the debug flag called "name" (e.g. "trace-execution") and return
+// false if there is no such flag
+bool setDebugFlag(const char *name);
+// Switch on every flag in a comma separated list of flag names and return false
+// if any of them is unknown
+bool setDebugFlags(const char *names);
+
+// Name of an opcode (e.g. "OP_CONSTANT") or "OP_UNKNOWN"
+const char *opcodeName(uint8_t instruction);
 
 // Disassemble "chunk" and display in human readable format labelled with "name"
 void disassembleChunk(Chunk *chunk, const char *name);
@@ -0,0 +1,263 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "gcstats.h"
+#include "heap.h"
+#include "memory.h"
+#include "vm.h"
+
+GCStats gcStats;
+
+static const char *reportPath = NULL;
+static bool reportEnabled = false;
+static bool reportWritten = false;
+
+/* Names of the per type statistics:
+         - "label" is the type's name in the report
+         - "count" is the statistic holding the number of objects on the heap
+         - "bytes" is the statistic holding the bytes those objects use
+ */
+typedef struct {
+  const char *label;
+  const char *count;
+  const char *bytes;
+} TypeNames;
+
+static const TypeNames typeNames[OBJ_TYPE_COUNT] = {
+    [OBJ_CLOSURE] = {"closure", "heapClosures", "closureBytes"},
+    [OBJ_FUNCTION] = {"function", "heapFunctions", "functionBytes"},
+    [OBJ_NATIVE] = {"native", "heapNatives", "nativeBytes"},
+    [OBJ_STRING] = {"string", "heapStrings", "stringBytes"},
+    [OBJ_UPVALUE] = {"upvalue", "heapUpvalues", "upvalueBytes"},
+};
+
+// Number and total size of the objects of each type on the heap
+typedef struct {
+  size_t objects[OBJ_TYPE_COUNT];
+  size_t bytes[OBJ_TYPE_COUNT];
+} HeapObjects;
+
+static void countObjects(HeapObjects *heap, Obj *objects) {
+  for (Obj *object = objects; object != NULL; object = objNext(object)) {
+    heap->objects[objType(object)]++;
+    heap->bytes[objType(object)] += objectSize(object);
+  }
+}
+
+// Walk the heap and count every object on it, including the unreachable ones
+// that have not been collected yet (which are only told apart during a
+// collection)
+static void countHeapObjects(HeapObjects *heap) {
+  memset(heap, 0, sizeof(HeapObjects));
+  countObjects(heap, vm.objects);
+  // Finishing a sweep in progress would count as a collection, so the objects
+  // it has not put back on "vm.objects" yet are counted where they are
+  Obj *toSweep;
+  Obj *survivors;
+  sweepInProgress(&toSweep, &survivors);
+  countObjects(heap, toSweep);
+  countObjects(heap, survivors);
+}
+
+// Number of strings in the intern table, which (unlike "count") leaves out
+// tombstones
+static size_t internedStrings() {
+  size_t count = 0;
+  for (int i = 0; i < vm.strings.capacity; i++)
+    if (vm.strings.entries[i].key != NULL)
+      count++;
+  return count;
+}
+
+void recordPause(uint64_t pauseNanos) {
+  gcStats.pauses++;
+  gcStats.pauseNanos += pauseNanos;
+  if (pauseNanos > gcStats.maxPauseNanos)
+    gcStats.maxPauseNanos = pauseNanos;
+
+  int bucket = 0;
+  for (uint64_t micros = pauseNanos / 1000; micros > 0; micros >>= 1)
+    bucket++;
+  if (bucket >= GC_PAUSE_BUCKETS)
+    bucket = GC_PAUSE_BUCKETS - 1;
+  gcStats.pauseHistogram[bucket]++;
+}
+
+void recordCollection(size_t bytesFreed, size_t objectsFreed, bool minor) {
+  gcStats.collections++;
+  if (minor)
+    gcStats.minorCollections++;
+
+  gcStats.bytesFreed += bytesFreed;
+  gcStats.objectsFreed += objectsFreed;
+  gcStats.lastBytesFreed = bytesFreed;
+  gcStats.lastObjectsFreed = objectsFreed;
+}
+
+void recordCompaction(size_t objectsMoved, size_t pages) {
+  gcStats.compactions++;
+  gcStats.objectsMoved += objectsMoved;
+  gcStats.pagesCompacted += pages;
+}
+
+bool gcStat(const char *name, double *value) {
+  if (strcmp(name, "collections") == 0)
+    *value = gcStats.collections;
+  else if (strcmp(name, "minorCollections") == 0)
+    *value = gcStats.minorCollections;
+  else if (strcmp(name, "pauses") == 0)
+    *value = gcStats.pauses;
+  else if (strcmp(name, "pauseNanos") == 0)
+    *value = gcStats.pauseNanos;
+  else if (strcmp(name, "maxPauseNanos") == 0)
+    *value = gcStats.maxPauseNanos;
+  else if (strcmp(name, "bytesFreed") == 0)
+    *value = gcStats.bytesFreed;
+  else if (strcmp(name, "objectsFreed") == 0)
+    *value = gcStats.objectsFreed;
+  else if (strcmp(name, "lastBytesFreed") == 0)
+    *value = gcStats.lastBytesFreed;
+  else if (strcmp(name, "lastObjectsFreed") == 0)
+    *value = gcStats.lastObjectsFreed;
+  else if (strcmp(name, "compactions") == 0)
+    *value = gcStats.compactions;
+  else if (strcmp(name, "objectsMoved") == 0)
+    *value = gcStats.objectsMoved;
+  else if (strcmp(name, "pagesCompacted") == 0)
+    *value = gcStats.pagesCompacted;
+  else if (strcmp(name, "bytesAllocated") == 0)
+    *value = vm.bytesAllocated;
+  else if (strcmp(name, "nextGC") == 0)
+    *value = vm.nextGC;
+  else if (strcmp(name, "internedStrings") == 0)
+    *value = internedStrings();
+  else if (strcmp(name, "internCapacity") == 0)
+    *value = vm.strings.capacity;
+  else if (strcmp(name, "heapPages") == 0)
+    *value = heapStats.pages;
+  else if (strcmp(name, "emptyPages") == 0)
+    *value = heapStats.emptyPages;
+  else if (strcmp(name, "largeObjects") == 0)
+    *value = heapStats.largeObjects;
+  else if (strcmp(name, "fragmentation") == 0)
+    *value = heapFragmentation();
+  else {
+    HeapObjects heap;
+    countHeapObjects(&heap);
+
+    size_t objects = 0;
+    size_t bytes = 0;
+    for (int type = 0; type < OBJ_TYPE_COUNT; type++) {
+      if (strcmp(name, typeNames[type].count) == 0) {
+        *value = heap.objects[type];
+        return true;
+      }
+      if (strcmp(name, typeNames[type].bytes) == 0) {
+        *value = heap.bytes[type];
+        return true;
+      }
+      objects += heap.objects[type];
+      bytes += heap.bytes[type];
+    }
+
+    if (strcmp(name, "heapObjects") == 0)
+      *value = objects;
+    else if (strcmp(name, "heapBytes") == 0)
+      *value = bytes;
+    else
+      return false;
+  }
+  return true;
+}
+
+void printGCStats(FILE *out) {
+  fprintf(out, "=== garbage collector ===\n");
+  fprintf(out, "collections (collections)        %14llu\n",
+          (unsigned long long)gcStats.collections);
+  fprintf(out, "minor (minorCollections)          %14llu\n",
+          (unsigned long long)gcStats.minorCollections);
+  fprintf(out, "pauses (pauses)                  %14llu\n",
+          (unsigned long long)gcStats.pauses);
+  fprintf(out, "total pause (pauseNanos)         %14.3f ms\n",
+          gcStats.pauseNanos / 1e6);
+  fprintf(out, "longest pause (maxPauseNanos)    %14.3f ms\n",
+          gcStats.maxPauseNanos / 1e6);
+  fprintf(out, "bytes freed (bytesFreed)         %14llu\n",
+          (unsigned long long)gcStats.bytesFreed);
+  fprintf(out, "objects freed (objectsFreed)     %14llu\n",
+          (unsigned long long)gcStats.objectsFreed);
+  fprintf(out, "last cycle (lastBytesFreed)      %14zu bytes\n",
+          gcStats.lastBytesFreed);
+  fprintf(out, "last cycle (lastObjectsFreed)    %14zu objects\n",
+          gcStats.lastObjectsFreed);
+  fprintf(out, "compactions (compactions)        %14llu\n",
+          (unsigned long long)gcStats.compactions);
+  fprintf(out, "objects moved (objectsMoved)     %14llu\n",
+          (unsigned long long)gcStats.objectsMoved);
+  fprintf(out, "pages emptied (pagesCompacted)   %14llu\n",
+          (unsigned long long)gcStats.pagesCompacted);
+  fprintf(out, "heap size (bytesAllocated)       %14zu\n", vm.bytesAllocated);
+  fprintf(out, "next collection at (nextGC)      %14zu\n", vm.nextGC);
+  fprintf(out, "interned strings (internedStrings) %12zu of %d slots\n",
+          internedStrings(), vm.strings.capacity);
+  fprintf(out, "object pages (heapPages)         %14zu of %d KiB\n",
+          heapStats.pages, HEAP_PAGE_SIZE / 1024);
+  fprintf(out, "returned pages (emptyPages)      %14zu\n", heapStats.emptyPages);
+  fprintf(out, "reclaimable pages (fragmentation) %13.1f%%\n",
+          heapFragmentation() * 100);
+  fprintf(out, "large objects (largeObjects)     %14zu\n",
+          heapStats.largeObjects);
+
+  fprintf(out, "\n=== pause histogram ===\n");
+  for (int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+    if (gcStats.pauseHistogram[i] == 0)
+      continue;
+    if (i == GC_PAUSE_BUCKETS - 1)
+      fprintf(out, ">= %8llu us", 1ull << (i - 1));
+    else
+      fprintf(out, "<  %8llu us", 1ull << i);
+    fprintf(out, " %14llu\n", (unsigned long long)gcStats.pauseHistogram[i]);
+  }
+
+  HeapObjects heap;
+  countHeapObjects(&heap);
+  size_t objects = 0;
+  size_t bytes = 0;
+  fprintf(out, "\n=== objects on the heap (reachable or not) ===\n");
+  fprintf(out, "%-10s %14s %14s\n", "type", "objects", "bytes");
+  for (int type = 0; type < OBJ_TYPE_COUNT; type++) {
+    fprintf(out, "%-10s %14zu %14zu\n", typeNames[type].label,
+            heap.objects[type], heap.bytes[type]);
+    objects += heap.objects[type];
+    bytes += heap.bytes[type];
+  }
+  fprintf(out, "%-10s %14zu %14zu\n", "total", objects, bytes);
+}
+
+void writeGCStatsReport() {
+  if (!reportEnabled || reportWritten)
+    return;
+  reportWritten = true;
+
+  FILE *out = stderr;
+  if (reportPath != NULL) {
+    out = fopen(reportPath, "w");
+    if (out == NULL) {
+      fprintf(stderr, "Couldn't open GC statistics report \"%s\"\n",
+              reportPath);
+      return;
+    }
+  }
+
+  printGCStats(out);
+
+  if (out != stderr)
+    fclose(out);
+}
+
+void enableGCStatsReport(const char *path) {
+  if (!reportEnabled)
+    atexit(writeGCStatsReport);
+  reportEnabled = true;
+  reportPath = path;
+}
@@ -0,0 +1,77 @@
+#ifndef clox_gcstats_h
+#define clox_gcstats_h
+
+#include <stdio.h>
+
+#include "common.h"
+#include "object.h"
+
+#define OBJ_TYPE_COUNT (OBJ_UPVALUE + 1)
+
+// Collection pauses are counted in buckets of powers of two microseconds:
+// bucket 0 holds pauses shorter than 1us, bucket i those of at least 2^(i-1)us
+// but shorter than 2^i us, and the last bucket every pause longer than that
+#define GC_PAUSE_BUCKETS 20
+
+/* Totals kept by the garbage collector:
+         - "collections" is the number of collections run so far, and
+   "minorCollections" how many of those only collected the nursery
+         - "pauseNanos" and "maxPauseNanos" are the total and the longest
+   time spent in "collectGarbage()"
+         - "pauses" is how many times the collector stopped the program, once
+   per collection or once per slice of an incremental one
+         - "pauseHistogram" counts those pauses by length (see
+   "GC_PAUSE_BUCKETS")
+         - "bytesFreed" and "objectsFreed" are what all collections freed
+   together, "lastBytesFreed" and "lastObjectsFreed" what the latest one freed
+         - "compactions" is the number of times the heap was compacted, which
+   moved "objectsMoved" objects and freed "pagesCompacted" pages
+ */
+typedef struct {
+  uint64_t collections;
+  uint64_t minorCollections;
+  uint64_t pauses;
+  uint64_t pauseNanos;
+  uint64_t maxPauseNanos;
+  uint64_t pauseHistogram[GC_PAUSE_BUCKETS];
+  uint64_t bytesFreed;
+  uint64_t objectsFreed;
+  size_t lastBytesFreed;
+  size_t lastObjectsFreed;
+  uint64_t compactions;
+  uint64_t objectsMoved;
+  uint64_t pagesCompacted;
+} GCStats;
+
+extern GCStats gcStats;
+
+// Add a pause of the program by the collector to "gcStats"
+void recordPause(uint64_t pauseNanos);
+
+// Add a finished collection to "gcStats"
+void recordCollection(size_t bytesFreed, size_t objectsFreed, bool minor);
+
+// Add a compaction that moved "objectsMoved" objects to empty "pages" pages to
+// "gcStats"
+void recordCompaction(size_t objectsMoved, size_t pages);
+
+// Store the current value of the statistic called "name" (e.g. "collections"
+// or "heapStrings", see "printGCStats()" for all of them) in "value". Returns
+// false if there is no such statistic
+bool gcStat(const char *name, double *value);
+
+// Print "gcStats", the heap size and the objects currently on the heap
+// (including unreachable ones that have not been collected yet), broken down by
+// type, to "out"
+void printGCStats(FILE *out);
+
+// Print the statistics to "path" (or to stderr if "path" is NULL) when the
+// interpreter exits
+void enableGCStatsReport(const char *path);
+
+// Write the report asked for by "enableGCStatsReport()" unless that has been
+// done already. "freeVM()" calls this before it frees the heap, so that the
+// objects are still there to be counted
+void writeGCStatsReport();
+
+#endif
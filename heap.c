@@ -0,0 +1,479 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "heap.h"
+
+HeapStats heapStats;
+
+// Cell sizes of the size classes. A small object gets a cell of the smallest
+// class it fits in
+static const size_t classSizes[] = {
+    16,   24,   32,   40,   48,   56,   64,   80,   96,   112,  128,  160,
+    192,  224,  256,  320,  384,  448,  512,  640,  768,  896,  1024, 1280,
+    1536, 1792, 2048, 2560, 3072, 3584, 4096, 5120, 6144, 7168, 8192};
+
+#define CLASS_COUNT (sizeof(classSizes) / sizeof(classSizes[0]))
+
+/* Header at the start of every page:
+         - "marks" is the mark bitmap (see "HEAP_MARK_WORDS")
+         - "next" links the pages of a size class that have free cells
+         - "bump" is the start of the cells that have never been used, up to
+   the end of the page
+         - "freeCells" is a list of cells that have been freed, each holding a
+   pointer to the next one
+         - "sizeClass" is the index of the page's size class
+         - "liveCells" is how many of its cells are in use
+         - "available" is whether the page is on its class's list
+         - "evacuating" is whether a compaction is moving its objects away
+   The page of a large object only uses "marks" and "bump", which is the end
+   of its mapping, and "liveCells" while its mapping is cached, to count the
+   collections it has been kept through
+ */
+typedef struct Page {
+  uint64_t marks[HEAP_MARK_WORDS];
+  struct Page *next;
+  uint8_t *bump;
+  void *freeCells;
+  int sizeClass;
+  int liveCells;
+  bool available;
+  bool evacuating;
+} Page;
+
+// Offset of the first cell of a page, past the header
+#define FIRST_CELL ((sizeof(Page) + 15) & ~(size_t)15)
+
+// Granularity of the OS's memory pages, which large objects are rounded up to
+#define OS_PAGE_SIZE ((size_t)4096)
+
+// The pages of each size class that have free cells
+static Page *availablePages[CLASS_COUNT];
+
+// Number of pages and of cells in use in each size class
+static size_t classPages[CLASS_COUNT];
+static size_t classCells[CLASS_COUNT];
+
+// The pages a compaction is emptying, which are on no list meanwhile
+static Page **evacuatedPages = NULL;
+static size_t evacuatedCount = 0;
+static size_t evacuatedCapacity = 0;
+
+// Size class of every object size up to "HEAP_MAX_SMALL", in steps of 8 bytes
+static uint8_t classIndex[HEAP_MAX_SMALL / 8 + 1];
+static bool classIndexReady = false;
+
+// Every page ever mapped, and the ones that are empty and can be reused
+static Page **mappedPages = NULL;
+static size_t mappedCount = 0;
+static size_t mappedCapacity = 0;
+static Page **emptyPages = NULL;
+static size_t emptyCount = 0;
+static size_t emptyCapacity = 0;
+
+// Mappings of large objects that have been freed, kept (up to
+// "LARGE_CACHE_BYTES" of them) for the next large objects of about their size
+// instead of going back to the OS. A collection frees them in batches, e.g.
+// every step of a string that keeps growing, and mapping each one afresh
+// costs more than copying it. Their memory past the header is handed back to
+// the OS all the same, and the ones that have not been reused by the next
+// collection are unmapped
+#define LARGE_CACHE_SIZE 256
+#define LARGE_CACHE_BYTES ((size_t)16 * 1024 * 1024)
+static Page *largeCache[LARGE_CACHE_SIZE];
+static int largeCacheCount = 0;
+static size_t largeCacheBytes = 0;
+
+// Whether another thread may be freeing objects, and the lock they then take
+static bool shared = false;
+static pthread_mutex_t heapLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void appendPage(Page ***pages, size_t *count, size_t *capacity,
+                       Page *page) {
+  if (*capacity < *count + 1) {
+    *capacity = *capacity < 8 ? 8 : *capacity * 2;
+    *pages = (Page **)realloc(*pages, sizeof(Page *) * *capacity);
+    if (*pages == NULL)
+      exit(1);
+  }
+  (*pages)[(*count)++] = page;
+}
+
+static void buildClassIndex() {
+  int sizeClass = 0;
+  for (size_t i = 0; i <= HEAP_MAX_SMALL / 8; i++) {
+    while (classSizes[sizeClass] < i * 8)
+      sizeClass++;
+    classIndex[i] = (uint8_t)sizeClass;
+  }
+  classIndexReady = true;
+}
+
+// Map "size" bytes aligned to "HEAP_PAGE_SIZE", so that the page of an object
+// can be found by masking its address. Returns NULL if the OS refuses
+static Page *mapAligned(size_t size) {
+  uint8_t *base = (uint8_t *)mmap(NULL, size + HEAP_PAGE_SIZE,
+                                  PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED)
+    return NULL;
+
+  uintptr_t aligned = ((uintptr_t)base + HEAP_PAGE_SIZE - 1) &
+                      ~(uintptr_t)(HEAP_PAGE_SIZE - 1);
+  size_t head = aligned - (uintptr_t)base;
+  if (head > 0)
+    munmap(base, head);
+  munmap((uint8_t *)aligned + size, HEAP_PAGE_SIZE - head);
+  return (Page *)aligned;
+}
+
+static Page *mapPage() {
+  Page *page = mapAligned(HEAP_PAGE_SIZE);
+  if (page == NULL)
+    return NULL;
+  appendPage(&mappedPages, &mappedCount, &mappedCapacity, page);
+  return page;
+}
+
+// Start a page for "sizeClass", reusing an empty one if there is any
+static Page *newPage(int sizeClass) {
+  Page *page;
+  if (emptyCount > 0) {
+    page = emptyPages[--emptyCount];
+    heapStats.emptyPages--;
+  } else if ((page = mapPage()) == NULL)
+    return NULL;
+  heapStats.pages++;
+  classPages[sizeClass]++;
+
+  memset(page->marks, 0, sizeof(page->marks));
+  page->bump = (uint8_t *)page + FIRST_CELL;
+  page->freeCells = NULL;
+  page->sizeClass = sizeClass;
+  page->liveCells = 0;
+  page->available = true;
+  page->evacuating = false;
+  page->next = availablePages[sizeClass];
+  availablePages[sizeClass] = page;
+  return page;
+}
+
+static void *allocateCell(size_t size) {
+  if (!classIndexReady)
+    buildClassIndex();
+  int sizeClass = classIndex[(size + 7) / 8];
+  size_t cellSize = classSizes[sizeClass];
+
+  Page *page = availablePages[sizeClass];
+  if (page == NULL && (page = newPage(sizeClass)) == NULL)
+    return NULL;
+
+  void *cell;
+  if (page->freeCells != NULL) {
+    cell = page->freeCells;
+    page->freeCells = *(void **)cell;
+  } else {
+    cell = page->bump;
+    page->bump += cellSize;
+  }
+  page->liveCells++;
+  classCells[sizeClass]++;
+
+  // A full page leaves the list until one of its cells is freed
+  if (page->freeCells == NULL &&
+      page->bump + cellSize > (uint8_t *)page + HEAP_PAGE_SIZE) {
+    availablePages[sizeClass] = page->next;
+    page->available = false;
+  }
+  return cell;
+}
+
+static void freeCell(void *cell) {
+  Page *page = (Page *)((uintptr_t)cell & ~(uintptr_t)(HEAP_PAGE_SIZE - 1));
+  *(void **)cell = page->freeCells;
+  page->freeCells = cell;
+  page->liveCells--;
+  classCells[page->sizeClass]--;
+
+  if (!page->available) {
+    page->available = true;
+    page->next = availablePages[page->sizeClass];
+    availablePages[page->sizeClass] = page;
+  }
+}
+
+// Size of the mapping of a large object
+static size_t mappingSize(Page *page) { return page->bump - (uint8_t *)page; }
+
+// Take the smallest cached mapping that holds "mapped" bytes without wasting
+// as much again, or return NULL
+static Page *reuseMapping(size_t mapped) {
+  int best = -1;
+  for (int i = 0; i < largeCacheCount; i++) {
+    size_t size = mappingSize(largeCache[i]);
+    if (size >= mapped && size <= 2 * mapped &&
+        (best < 0 || size < mappingSize(largeCache[best])))
+      best = i;
+  }
+  if (best < 0)
+    return NULL;
+
+  Page *page = largeCache[best];
+  largeCache[best] = largeCache[--largeCacheCount];
+  largeCacheBytes -= mappingSize(page);
+  memset(page->marks, 0, sizeof(page->marks));
+  return page;
+}
+
+// Keep the mapping of a freed large object for reuse, or unmap it
+static void releaseMapping(Page *page) {
+  size_t size = mappingSize(page);
+  if (largeCacheCount < LARGE_CACHE_SIZE &&
+      largeCacheBytes + size <= LARGE_CACHE_BYTES) {
+    // The header (in the first memory page) has to stay, since it holds the
+    // size of the mapping
+    madvise((uint8_t *)page + OS_PAGE_SIZE, size - OS_PAGE_SIZE,
+            MADV_DONTNEED);
+    page->liveCells = 0;
+    largeCache[largeCacheCount++] = page;
+    largeCacheBytes += size;
+  } else
+    munmap(page, size);
+}
+
+// Unmap the cached mappings that have been kept through a whole collection
+// without being reused
+static void trimLargeCache() {
+  for (int i = 0; i < largeCacheCount;) {
+    Page *page = largeCache[i];
+    if (page->liveCells++ == 0) {
+      i++;
+      continue;
+    }
+    largeCacheBytes -= mappingSize(page);
+    largeCache[i] = largeCache[--largeCacheCount];
+    munmap(page, mappingSize(page));
+  }
+}
+
+void *heapAllocate(size_t size) {
+  if (shared)
+    pthread_mutex_lock(&heapLock);
+
+  void *object;
+  if (size <= HEAP_MAX_SMALL)
+    object = allocateCell(size);
+  else {
+    // Only the memory pages actually used are mapped, the rest of the
+    // alignment is just address space. A fresh mapping is zeroed, so the
+    // mark bit is clear
+    size_t mapped =
+        (FIRST_CELL + size + OS_PAGE_SIZE - 1) & ~(OS_PAGE_SIZE - 1);
+    // A reused mapping may be larger, and keeps its own size
+    Page *page = reuseMapping(mapped);
+    if (page == NULL && (page = mapAligned(mapped)) != NULL)
+      page->bump = (uint8_t *)page + mapped;
+    if (page != NULL) {
+      object = (uint8_t *)page + FIRST_CELL;
+      heapStats.largeObjects++;
+      heapStats.largeBytes += size;
+    } else
+      object = NULL;
+  }
+
+  if (shared)
+    pthread_mutex_unlock(&heapLock);
+  return object;
+}
+
+void heapFree(void *object, size_t size) {
+  if (shared)
+    pthread_mutex_lock(&heapLock);
+
+  if (size <= HEAP_MAX_SMALL)
+    freeCell(object);
+  else {
+    releaseMapping((Page *)((uint8_t *)object - FIRST_CELL));
+    heapStats.largeObjects--;
+    heapStats.largeBytes -= size;
+  }
+
+  if (shared)
+    pthread_mutex_unlock(&heapLock);
+}
+
+void setHeapShared(bool isShared) { shared = isShared; }
+
+// Give back the memory of "page", which is on no list, and keep it for reuse
+static void releasePage(Page *page) {
+  // Before the header is gone
+  classPages[page->sizeClass]--;
+  // The page stays mapped for reuse, but the OS may take its memory back
+  // (reading it again gives zeroes)
+  madvise(page, HEAP_PAGE_SIZE, MADV_DONTNEED);
+  appendPage(&emptyPages, &emptyCount, &emptyCapacity, page);
+  heapStats.pages--;
+  heapStats.emptyPages++;
+}
+
+void releaseEmptyPages() {
+  trimLargeCache();
+  for (size_t sizeClass = 0; sizeClass < CLASS_COUNT; sizeClass++) {
+    Page **link = &availablePages[sizeClass];
+    while (*link != NULL) {
+      Page *page = *link;
+      if (page->liveCells > 0) {
+        link = &page->next;
+        continue;
+      }
+
+      *link = page->next;
+      releasePage(page);
+    }
+  }
+}
+
+// Number of cells that fit on a page of "sizeClass"
+static size_t cellsPerPage(size_t sizeClass) {
+  return (HEAP_PAGE_SIZE - FIRST_CELL) / classSizes[sizeClass];
+}
+
+double heapFragmentation() {
+  size_t pages = 0;
+  size_t needed = 0;
+  for (size_t sizeClass = 0; sizeClass < CLASS_COUNT; sizeClass++) {
+    size_t perPage = cellsPerPage(sizeClass);
+    pages += classPages[sizeClass];
+    needed += (classCells[sizeClass] + perPage - 1) / perPage;
+  }
+  return pages == 0 ? 0 : (double)(pages - needed) / pages;
+}
+
+double heapFragmentationOfMarked() {
+  size_t pages[CLASS_COUNT] = {0};
+  size_t marked[CLASS_COUNT] = {0};
+  // Only the first granule of an object has its bit set, and an empty page
+  // has a zeroed header, so it adds nothing
+  for (size_t i = 0; i < mappedCount; i++) {
+    Page *page = mappedPages[i];
+    size_t count = 0;
+    for (size_t word = 0; word < HEAP_MARK_WORDS; word++)
+      count += __builtin_popcountll(
+          __atomic_load_n(&page->marks[word], __ATOMIC_RELAXED));
+    if (count > 0) {
+      pages[page->sizeClass]++;
+      marked[page->sizeClass] += count;
+    }
+  }
+
+  size_t total = 0;
+  size_t needed = 0;
+  for (size_t sizeClass = 0; sizeClass < CLASS_COUNT; sizeClass++) {
+    size_t perPage = cellsPerPage(sizeClass);
+    total += pages[sizeClass];
+    needed += (marked[sizeClass] + perPage - 1) / perPage;
+  }
+  return total == 0 ? 0 : (double)(total - needed) / total;
+}
+
+static int compareLiveCells(const void *a, const void *b) {
+  int left = (*(Page *const *)a)->liveCells;
+  int right = (*(Page *const *)b)->liveCells;
+  return (left > right) - (left < right);
+}
+
+size_t heapBeginEvacuation() {
+  Page **pages = NULL;
+  size_t capacity = 0;
+  for (size_t sizeClass = 0; sizeClass < CLASS_COUNT; sizeClass++) {
+    size_t count = 0;
+    for (Page *page = availablePages[sizeClass]; page != NULL;
+         page = page->next)
+      appendPage(&pages, &count, &capacity, page);
+    if (count < 2)
+      continue;
+
+    // Empty the sparsest pages for as long as their objects still fit in
+    // the free cells of the others
+    qsort(pages, count, sizeof(Page *), compareLiveCells);
+    size_t perPage = cellsPerPage(sizeClass);
+    size_t room = 0;
+    for (size_t i = 0; i < count; i++)
+      room += perPage - pages[i]->liveCells;
+    size_t moving = 0;
+    size_t evacuated = 0;
+    while (evacuated < count) {
+      Page *page = pages[evacuated];
+      room -= perPage - page->liveCells;
+      if (moving + page->liveCells > room)
+        break;
+      moving += page->liveCells;
+      evacuated++;
+    }
+
+    availablePages[sizeClass] = NULL;
+    for (size_t i = count; i-- > 0;) {
+      Page *page = pages[i];
+      if (i < evacuated) {
+        page->evacuating = true;
+        page->available = false;
+        appendPage(&evacuatedPages, &evacuatedCount, &evacuatedCapacity,
+                   page);
+      } else {
+        page->next = availablePages[sizeClass];
+        availablePages[sizeClass] = page;
+      }
+    }
+  }
+  free(pages);
+  return evacuatedCount;
+}
+
+bool heapIsEvacuating(const void *object) {
+  // The page of a large object is never evacuated, and its "evacuating" is
+  // still zero from the mapping
+  Page *page = (Page *)((uintptr_t)object & ~(uintptr_t)(HEAP_PAGE_SIZE - 1));
+  return page->evacuating;
+}
+
+void heapEndEvacuation() {
+  for (size_t i = 0; i < evacuatedCount; i++) {
+    Page *page = evacuatedPages[i];
+    classCells[page->sizeClass] -= page->liveCells;
+    page->liveCells = 0;
+    page->evacuating = false;
+    releasePage(page);
+  }
+  evacuatedCount = 0;
+}
+
+void freeHeap() {
+  for (size_t i = 0; i < mappedCount; i++)
+    munmap(mappedPages[i], HEAP_PAGE_SIZE);
+  for (int i = 0; i < largeCacheCount; i++)
+    munmap(largeCache[i], mappingSize(largeCache[i]));
+  largeCacheCount = 0;
+  largeCacheBytes = 0;
+  free(mappedPages);
+  free(emptyPages);
+  free(evacuatedPages);
+  mappedPages = NULL;
+  mappedCount = 0;
+  mappedCapacity = 0;
+  emptyPages = NULL;
+  emptyCount = 0;
+  emptyCapacity = 0;
+  evacuatedPages = NULL;
+  evacuatedCount = 0;
+  evacuatedCapacity = 0;
+
+  for (size_t sizeClass = 0; sizeClass < CLASS_COUNT; sizeClass++) {
+    availablePages[sizeClass] = NULL;
+    classPages[sizeClass] = 0;
+    classCells[sizeClass] = 0;
+  }
+  heapStats.pages = 0;
+  heapStats.emptyPages = 0;
+}
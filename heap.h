@@ -0,0 +1,111 @@
+#ifndef clox_heap_h
+#define clox_heap_h
+
+#include <stdint.h>
+
+#include "common.h"
+
+// Size and alignment of the pages that small objects are carved from
+#define HEAP_PAGE_SIZE (64 * 1024)
+
+// Objects larger than this are allocated one by one in the large object space
+#define HEAP_MAX_SMALL 8192
+
+// Every page (including the one of each large object) starts with a mark
+// bitmap holding one bit for every "HEAP_GRANULE" bytes of the page, so the
+// mark bit of an object is found from its address alone and marking never
+// writes to the objects themselves
+#define HEAP_GRANULE 8
+#define HEAP_MARK_WORDS (HEAP_PAGE_SIZE / HEAP_GRANULE / 64)
+
+// The word of the mark bitmap holding the bit of "object", and the bit itself
+static inline uint64_t *markWord(const void *object, uint64_t *bit) {
+  uintptr_t address = (uintptr_t)object;
+  uint64_t *bitmap = (uint64_t *)(address & ~(uintptr_t)(HEAP_PAGE_SIZE - 1));
+  size_t granule = (address & (HEAP_PAGE_SIZE - 1)) / HEAP_GRANULE;
+  *bit = (uint64_t)1 << (granule % 64);
+  return &bitmap[granule / 64];
+}
+
+// Bits of the same word belong to different objects, which other threads may
+// be marking or sweeping at the same time, so all accesses are atomic. Only
+// the read-modify-write of "heapMark()" costs more than a plain access
+
+static inline bool heapIsMarked(const void *object) {
+  uint64_t bit;
+  uint64_t *word = markWord(object, &bit);
+  return (__atomic_load_n(word, __ATOMIC_RELAXED) & bit) != 0;
+}
+
+// Set the mark bit of "object" and return whether it was set already
+static inline bool heapMark(void *object) {
+  uint64_t bit;
+  uint64_t *word = markWord(object, &bit);
+  return (__atomic_fetch_or(word, bit, __ATOMIC_ACQ_REL) & bit) != 0;
+}
+
+static inline void heapClearMark(void *object) {
+  uint64_t bit;
+  uint64_t *word = markWord(object, &bit);
+  __atomic_fetch_and(word, ~bit, __ATOMIC_RELAXED);
+}
+
+/* Totals kept by the object heap:
+         - "pages" is the number of pages holding objects, and "emptyPages"
+   how many more have been handed back to the OS but kept for reuse
+         - "largeObjects" and "largeBytes" describe the large object space
+ */
+typedef struct {
+  size_t pages;
+  size_t emptyPages;
+  size_t largeObjects;
+  size_t largeBytes;
+} HeapStats;
+
+extern HeapStats heapStats;
+
+// Return memory for an object of "size" bytes, with its mark bit clear. Small
+// objects come from the free list or the bump pointer of a page of their size
+// class, large ones get pages of their own (reusing those of large objects
+// freed recently). Returns NULL if the OS has no memory left
+void *heapAllocate(size_t size);
+
+// Give back the memory of an object of "size" bytes allocated by
+// "heapAllocate()"
+void heapFree(void *object, size_t size);
+
+// Let another thread free objects while the main thread keeps allocating (or
+// stop letting it), which makes both take a lock
+void setHeapShared(bool shared);
+
+// Hand pages without any objects on them back to the OS, and unmap the freed
+// large object mappings that were not reused since the previous call. Called
+// after collections
+void releaseEmptyPages();
+
+// Fraction of the small object pages in use that would become empty if every
+// size class had its objects packed together
+double heapFragmentation();
+
+// What "heapFragmentation()" will be once every object without its mark bit
+// set has been freed, i.e. after the sweep of a collection whose marking is
+// complete
+double heapFragmentationOfMarked();
+
+// Start a compaction: take the sparsest pages of each size class off its list,
+// as many of them as the free cells of the other pages can take the objects
+// of, and return how many were taken. The objects on them must then be moved
+// with "heapAllocate()" (which now never returns a cell on one of them) before
+// "heapEndEvacuation()" frees the pages
+size_t heapBeginEvacuation();
+
+// Whether "object" is on a page that the current compaction is emptying
+bool heapIsEvacuating(const void *object);
+
+// Free the pages that were evacuated, along with every object left on them
+void heapEndEvacuation();
+
+// Unmap every page and forget all objects
+void freeHeap();
+
+#endif
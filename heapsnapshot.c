@@ -0,0 +1,215 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "heapsnapshot.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+// Longest label written for an object, longer strings are cut off
+#define MAX_LABEL 60
+
+volatile sig_atomic_t snapshotRequested = 0;
+
+// Number of snapshots SIGUSR2 has asked for, which numbers their files
+static int signalSnapshots = 0;
+
+static const char *typeNames[] = {
+    [OBJ_CLOSURE] = "closure", [OBJ_FUNCTION] = "function",
+    [OBJ_NATIVE] = "native",   [OBJ_STRING] = "string",
+    [OBJ_UPVALUE] = "upvalue",
+};
+
+static const char *functionLabel(ObjFunction *function) {
+  return function->name != NULL ? function->name->chars : "script";
+}
+
+// Write at most "MAX_LABEL" characters of "text", escaping the ones that
+// would break the line based format
+static void writeLabel(FILE *out, const char *text, int length) {
+  int limit = length < MAX_LABEL ? length : MAX_LABEL;
+  for (int i = 0; i < limit; i++) {
+    unsigned char c = (unsigned char)text[i];
+    if (c == '\\')
+      fputs("\\\\", out);
+    else if (c == '\n')
+      fputs("\\n", out);
+    else if (c == '\t')
+      fputs("\\t", out);
+    else if (c < ' ')
+      fprintf(out, "\\x%02x", c);
+    else
+      fputc(c, out);
+  }
+  if (length > limit)
+    fputs("...", out);
+}
+
+static void writeObject(FILE *out, Obj *object) {
+  fprintf(out, "object %p %s %zu ", (void *)object, typeNames[objType(object)],
+          objectSize(object));
+  switch (objType(object)) {
+  case OBJ_CLOSURE:
+    fputs(functionLabel(((ObjClosure *)object)->function), out);
+    break;
+  case OBJ_FUNCTION:
+    fputs(functionLabel((ObjFunction *)object), out);
+    break;
+  case OBJ_NATIVE:
+    fputs(((ObjNative *)object)->name, out);
+    break;
+  case OBJ_STRING: {
+    ObjString *string = (ObjString *)object;
+    writeLabel(out, string->chars, string->length);
+    break;
+  }
+  case OBJ_UPVALUE:
+    fputs(((ObjUpvalue *)object)->location == &((ObjUpvalue *)object)->closed
+              ? "closed"
+              : "open",
+          out);
+    break;
+  }
+  fputc('\n', out);
+}
+
+// Write the reference called "name" (followed by "[index]" unless "index" is
+// negative) from "from" to "to"
+static void writeEdge(FILE *out, Obj *from, Obj *to, const char *name,
+                      int index) {
+  if (to == NULL)
+    return;
+  fprintf(out, "edge %p %p %s", (void *)from, (void *)to, name);
+  if (index >= 0)
+    fprintf(out, "[%d]", index);
+  fputc('\n', out);
+}
+
+static void writeValueEdge(FILE *out, Obj *from, Value value,
+                           const char *name, int index) {
+  if (IS_OBJ(value))
+    writeEdge(out, from, AS_OBJ(value), name, index);
+}
+
+// The references of "object", which are the ones "blackenObject()" follows
+static void writeEdges(FILE *out, Obj *object) {
+  switch (objType(object)) {
+  case OBJ_CLOSURE: {
+    ObjClosure *closure = (ObjClosure *)object;
+    writeEdge(out, object, (Obj *)closure->function, "function", -1);
+    for (int i = 0; i < closure->upvalueCount; i++)
+      writeEdge(out, object, (Obj *)closure->upvalues[i], "upvalue", i);
+    break;
+  }
+  case OBJ_FUNCTION: {
+    ObjFunction *function = (ObjFunction *)object;
+    writeEdge(out, object, (Obj *)function->name, "name", -1);
+    for (int i = 0; i < function->chunk.constants.count; i++)
+      writeValueEdge(out, object, function->chunk.constants.values[i],
+                     "constant", i);
+    break;
+  }
+  case OBJ_UPVALUE:
+    writeValueEdge(out, object, ((ObjUpvalue *)object)->closed, "value", -1);
+    break;
+  case OBJ_NATIVE:
+  case OBJ_STRING:
+    break;
+  }
+}
+
+// Write a root of kind "kind" (e.g. "global") that refers to "value"
+static void writeRoot(FILE *out, const char *kind, Value value,
+                      const char *name) {
+  if (!IS_OBJ(value))
+    return;
+  fprintf(out, "root %s %p %s\n", kind, (void *)AS_OBJ(value), name);
+}
+
+// The roots "markRoots()" starts from, except the compiler's (a snapshot is
+// only taken while running) and the intern table, which doesn't keep strings
+// alive
+static void writeRoots(FILE *out) {
+  char name[128];
+  for (int i = 0; i < vm.globals.capacity; i++) {
+    Entry *entry = &vm.globals.entries[i];
+    if (entry->key == NULL)
+      continue;
+    writeRoot(out, "global", OBJ_VAL(entry->key), entry->key->chars);
+    writeRoot(out, "global", entry->value, entry->key->chars);
+  }
+
+  for (int i = 0; i < vm.frameCount; i++) {
+    CallFrame *frame = &vm.frames[i];
+    const char *function = functionLabel(frame->closure->function);
+    writeRoot(out, "frame", OBJ_VAL(frame->closure), function);
+
+    // The slots of a frame end where those of the next one begin
+    Value *end = i + 1 < vm.frameCount ? vm.frames[i + 1].slots : vm.stackTop;
+    for (Value *slot = frame->slots; slot < end; slot++) {
+      snprintf(name, sizeof(name), "%s slot %d", function,
+               (int)(slot - frame->slots));
+      writeRoot(out, "stack", *slot, name);
+    }
+  }
+
+  for (ObjUpvalue *upvalue = vm.openUpvalues; upvalue != NULL;
+       upvalue = upvalue->next) {
+    snprintf(name, sizeof(name), "stack slot %d",
+             (int)(upvalue->location - vm.stack));
+    writeRoot(out, "upvalue", OBJ_VAL(upvalue), name);
+  }
+}
+
+bool writeHeapSnapshot(const char *path) {
+  FILE *out = fopen(path, "w");
+  if (out == NULL)
+    return false;
+
+  // Leave out the garbage that hasn't been collected yet, which would only
+  // bury what the program is holding on to (this also finishes any sweep in
+  // progress, whose objects are not on "vm.objects")
+  collectAllGarbage();
+
+  fprintf(out, "clox-heap-snapshot 1\n");
+  writeRoots(out);
+  for (Obj *object = vm.objects; object != NULL; object = objNext(object)) {
+    writeObject(out, object);
+    writeEdges(out, object);
+  }
+
+  bool written = !ferror(out);
+  if (fclose(out) != 0)
+    written = false;
+  return written;
+}
+
+static void handleSnapshotSignal(int signal) {
+  (void)signal;
+  // Walking the heap here would not be async-signal-safe, so just ask "run()"
+  // to do it at its next safepoint
+  snapshotRequested = 1;
+  vm.safepointRequested = 1;
+}
+
+bool enableSnapshotSignal() {
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = handleSnapshotSignal;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  return sigaction(SIGUSR2, &action, NULL) == 0;
+}
+
+void writeRequestedSnapshot() {
+  snapshotRequested = 0;
+
+  char path[64];
+  snprintf(path, sizeof(path), "clox.%ld.%d.heapsnapshot", (long)getpid(),
+           ++signalSnapshots);
+  if (writeHeapSnapshot(path))
+    fprintf(stderr, "Wrote heap snapshot %s\n", path);
+  else
+    fprintf(stderr, "Couldn't write heap snapshot %s\n", path);
+}
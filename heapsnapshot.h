@@ -0,0 +1,26 @@
+#ifndef clox_heapsnapshot_h
+#define clox_heapsnapshot_h
+
+#include <signal.h>
+
+#include "common.h"
+
+// Set by the SIGUSR2 handler when a snapshot should be written at the next
+// safepoint
+extern volatile sig_atomic_t snapshotRequested;
+
+// Collect all the garbage, then write every object left on the heap (with its
+// type, size and a label), the references between objects and the roots that
+// refer to them to "path" in the text format read by "tools/heapdiff.py".
+// Returns false if the file can't be written
+bool writeHeapSnapshot(const char *path);
+
+// Make SIGUSR2 write a snapshot to "clox.<pid>.<n>.heapsnapshot" in the
+// current directory. Returns false if the handler can't be installed
+bool enableSnapshotSignal();
+
+// Write the snapshot that SIGUSR2 asked for (called from a safepoint in
+// "run()")
+void writeRequestedSnapshot();
+
+#endif
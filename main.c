@@ -4,7 +4,16 @@
 
 #include "chunk.h"
 #include "common.h"
+#include "allocsites.h"
+#include "callprofile.h"
 #include "debug.h"
+#include "gcstats.h"
+#include "heapsnapshot.h"
+#include "memory.h"
+#include "opstats.h"
+#include "perfcounters.h"
+#include "profiler.h"
+#include "timeline.h"
 #include "vm.h"
 
 static void repl() {
@@ -72,20 +81,297 @@ static void runFile(const char *path) {
     exit(70);
 }
 
+static void usage() {
+  fprintf(stderr,
+          "Usage: clox [options] [path]\n"
+          "\n"
+          "Debug options (only available in builds with -DCLOX_DEBUG):\n"
+          "  --print-code       Disassemble every chunk after compiling it\n"
+          "  --trace-execution  Print the stack and every instruction as it "
+          "runs\n"
+          "  --stress-gc        Collect garbage on every allocation\n"
+          "  --log-gc           Log allocations and garbage collection\n"
+          "\n"
+          "Garbage collector options (sizes in bytes, optionally ending in "
+          "k, m or g):\n"
+          "  --gc=mode            stw (default) collects the whole heap every "
+          "time,\n"
+          "                       generational mostly collects young objects,\n"
+          "                       incremental marks in slices between "
+          "instructions\n"
+          "                       concurrent marks on a background thread\n"
+          "  --gc-nursery=size    Bytes allocated between collections of "
+          "young\n"
+          "                       objects in generational mode (default "
+          "256k)\n"
+          "  --gc-step=size       Bytes allocated between slices of "
+          "incremental\n"
+          "                       marking or checks for the end of "
+          "concurrent\n"
+          "                       marking (default 64k)\n"
+          "  --gc-slice=us        Time budget of each slice in microseconds\n"
+          "                       (default 500)\n"
+          "  --gc-mark-threads=n  Threads that mark the heap together "
+          "(default 1)\n"
+          "  --gc-sweep=mode      eager (default) frees unreachable objects "
+          "in the\n"
+          "                       pause, lazy a few for every --gc-step "
+          "bytes,\n"
+          "                       background on a thread of its own\n"
+          "  --gc-compact=fraction\n"
+          "                       Compact the heap after collections that "
+          "leave\n"
+          "                       more than this fraction of its pages "
+          "reclaimable,\n"
+          "                       sweeping those in the pause whatever "
+          "--gc-sweep\n"
+          "                       says (default 0, never)\n"
+          "  --gc-threshold=size  Heap size of the first collection "
+          "(default 1m)\n"
+          "  --gc-growth=factor   Collect again once the heap has grown to "
+          "this\n"
+          "                       multiple of the live data (default 2)\n"
+          "  --gc-min-heap=size   Never collect below this heap size "
+          "(default 1m)\n"
+          "  --gc-max-heap=size   Don't let the heap grow past this size "
+          "before\n"
+          "                       collecting (default 0, unbounded)\n"
+          "  --heap-limit=size    Stop the program with an out of memory "
+          "error if\n"
+          "                       the heap outgrows this size even after "
+          "collecting\n"
+          "                       (default 0, no limit)\n"
+          "  --gc-stats[=file]    Report collection counts, pause times and "
+          "objects\n"
+          "                       on the heap by type (reachable or not) at "
+          "exit\n"
+          "\n"
+          "Profiling options:\n"
+          "  --profile[=file]   Sample the Lox call stack and write folded "
+          "stacks\n"
+          "                     for flame graphs to file (default "
+          "clox.folded)\n"
+          "  --profile-hz=n     Samples per second of CPU time (default 1000)\n"
+          "  --trace-events[=file]\n"
+          "                     Write a Chrome trace event timeline of "
+          "compilation,\n"
+          "                     garbage collection and (in CLOX_PROFILE "
+          "builds)\n"
+          "                     top level calls (default clox-trace.json)\n"
+          "  --perf-counters    Report hardware performance counters for\n"
+          "                     compilation, execution and garbage "
+          "collection\n"
+          "\n"
+          "Profiling options (only available in builds with -DCLOX_PROFILE):\n"
+          "  --opstats[=file]   Count executed opcodes, opcode pairs and "
+          "triples\n"
+          "                     and report them at exit\n"
+          "  --callgrind[=file] Record every call and write time and "
+          "allocations\n"
+          "                     per function in callgrind format (default\n"
+          "                     callgrind.out.clox)\n"
+          "  --alloc-sites[=file]\n"
+          "                     Attribute object allocations to the Lox "
+          "function\n"
+          "                     and line making them and report bytes and "
+          "objects\n"
+          "                     per site at exit\n"
+          "  --alloc-sites-rate=bytes\n"
+          "                     Take one sample about every this many bytes\n"
+          "                     (default 4096, 1 records every "
+          "allocation)\n"
+          "\n"
+          "Debug options can also be given as a comma separated list in the\n"
+          "CLOX_DEBUG environment variable, e.g. "
+          "CLOX_DEBUG=trace-execution,log-gc\n"
+          "and garbage collector options in CLOX_GC, CLOX_GC_NURSERY,\n"
+          "CLOX_GC_STEP, CLOX_GC_SLICE, CLOX_GC_MARK_THREADS,\n"
+          "CLOX_GC_SWEEP, CLOX_GC_COMPACT, CLOX_GC_THRESHOLD, "
+          "CLOX_GC_GROWTH,\n"
+          "CLOX_GC_MIN_HEAP, CLOX_GC_MAX_HEAP and CLOX_HEAP_LIMIT\n");
+  exit(64);
+}
+
+// Switch on debug flags, warning when they are not compiled in
+static void enableDebugFlags(const char *names, const char *source) {
+  if (!setDebugFlags(names)) {
+    fprintf(stderr, "Unknown debug option in %s\n", source);
+    usage();
+  }
+#ifndef CLOX_DEBUG
+  fprintf(stderr,
+          "Warning: clox was built without CLOX_DEBUG, %s has no effect\n",
+          source);
+#endif
+}
+
+// Garbage collector options and the environment variables that set them too
+static const char *gcOptions[][2] = {
+    {"gc", "CLOX_GC"},
+    {"gc-nursery", "CLOX_GC_NURSERY"},
+    {"gc-step", "CLOX_GC_STEP"},
+    {"gc-slice", "CLOX_GC_SLICE"},
+    {"gc-mark-threads", "CLOX_GC_MARK_THREADS"},
+    {"gc-sweep", "CLOX_GC_SWEEP"},
+    {"gc-compact", "CLOX_GC_COMPACT"},
+    {"gc-threshold", "CLOX_GC_THRESHOLD"},
+    {"gc-growth", "CLOX_GC_GROWTH"},
+    {"gc-min-heap", "CLOX_GC_MIN_HEAP"},
+    {"gc-max-heap", "CLOX_GC_MAX_HEAP"},
+    {"heap-limit", "CLOX_HEAP_LIMIT"},
+};
+
+#define GC_OPTION_COUNT (sizeof(gcOptions) / sizeof(gcOptions[0]))
+
+// Apply the garbage collector options set in the environment
+static void readGCEnvironment() {
+  for (size_t i = 0; i < GC_OPTION_COUNT; i++) {
+    const char *value = getenv(gcOptions[i][1]);
+    if (value != NULL && value[0] != '\0' &&
+        !setGCOption(gcOptions[i][0], value)) {
+      fprintf(stderr, "Invalid value \"%s\" in %s\n", value, gcOptions[i][1]);
+      usage();
+    }
+  }
+}
+
+// Output path and frequency for "--profile", which is started once every
+// option has been read
+static const char *profilePath = NULL;
+static int profileFrequency = 1000;
+// Output path for "--callgrind", which needs the script path as well
+static const char *callgrindPath = NULL;
+// Output path (NULL for stderr) and sampling rate for "--alloc-sites", which
+// is started once every option has been read
+static bool allocSitesRequested = false;
+static const char *allocSitesPath = NULL;
+static size_t allocSitesRate = 4096;
+
+// Check that the profiling hooks needed by "option" are compiled in and warn
+// if they are not
+static bool requireProfiling(const char *option) {
+#ifndef CLOX_PROFILE
+  fprintf(stderr,
+          "Warning: clox was built without CLOX_PROFILE, %s has no effect\n",
+          option);
+  return false;
+#else
+  return true;
+#endif
+}
+
+// If "option" is "--<name>" or "--<name>=<value>" then return its value (or an
+// empty string if it has none), otherwise return NULL
+static const char *optionValue(const char *option, const char *name) {
+  size_t length = strlen(name);
+  if (strncmp(option + 2, name, length) != 0)
+    return NULL;
+
+  const char *rest = option + 2 + length;
+  if (*rest == '\0')
+    return rest;
+  if (*rest == '=')
+    return rest + 1;
+  return NULL;
+}
+
+// Handle a single "--option" command line argument
+static void parseOption(const char *option) {
+  const char *value;
+
+  for (size_t i = 0; i < GC_OPTION_COUNT; i++)
+    if ((value = optionValue(option, gcOptions[i][0])) != NULL) {
+      if (!setGCOption(gcOptions[i][0], value)) {
+        fprintf(stderr, "Invalid value for %s\n", option);
+        usage();
+      }
+      return;
+    }
+
+  if (strcmp(option, "--help") == 0)
+    usage();
+  else if ((value = optionValue(option, "profile-hz")) != NULL) {
+    profileFrequency = atoi(value);
+    if (profileFrequency <= 0)
+      usage();
+  } else if ((value = optionValue(option, "profile")) != NULL)
+    profilePath = *value != '\0' ? value : "clox.folded";
+  else if ((value = optionValue(option, "gc-stats")) != NULL)
+    enableGCStatsReport(*value != '\0' ? value : NULL);
+  else if (strcmp(option, "--perf-counters") == 0) {
+    // Carry on without them if the kernel doesn't allow it
+    enablePerfCounters();
+  } else if ((value = optionValue(option, "trace-events")) != NULL) {
+    const char *tracePath = *value != '\0' ? value : "clox-trace.json";
+    if (!enableTimeline(tracePath)) {
+      fprintf(stderr, "Couldn't open trace event output \"%s\"\n", tracePath);
+      exit(74);
+    }
+  } else if ((value = optionValue(option, "opstats")) != NULL) {
+    if (requireProfiling(option))
+      enableOpstats(*value != '\0' ? value : NULL);
+  } else if ((value = optionValue(option, "alloc-sites-rate")) != NULL) {
+    char *end;
+    long long rate = strtoll(value, &end, 10);
+    if (end == value || *end != '\0' || rate < 1)
+      usage();
+    allocSitesRate = (size_t)rate;
+  } else if ((value = optionValue(option, "alloc-sites")) != NULL) {
+    if (requireProfiling(option)) {
+      allocSitesRequested = true;
+      allocSitesPath = *value != '\0' ? value : NULL;
+    }
+  } else if ((value = optionValue(option, "callgrind")) != NULL) {
+    if (requireProfiling(option))
+      callgrindPath = *value != '\0' ? value : "callgrind.out.clox";
+  } else
+    enableDebugFlags(option + 2, option);
+}
+
 int main(int argc, const char *argv[]) {
+  const char *path = NULL;
+
+  const char *debugEnv = getenv("CLOX_DEBUG");
+  if (debugEnv != NULL && debugEnv[0] != '\0')
+    enableDebugFlags(debugEnv, "CLOX_DEBUG");
+  readGCEnvironment();
+
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--", 2) == 0)
+      parseOption(argv[i]);
+    else if (path == NULL)
+      path = argv[i];
+    else
+      usage();
+  }
+
+#ifdef PROFILE_CALLS
+  if (callgrindPath != NULL)
+    enableCallProfiling(callgrindPath, path != NULL ? path : "<repl>");
+#endif
+#ifdef PROFILE_ALLOCSITES
+  if (allocSitesRequested)
+    enableAllocSites(allocSitesPath, allocSitesRate);
+#endif
+
   // Init
   initVM();
 
-  if (argc == 1)
-    repl();
-  else if (argc == 2)
-    runFile(argv[1]);
-  else {
-    fprintf(stderr, "Usage: clox <path>\n");
-    exit(64);
+  // Without the handler SIGUSR2 would just kill the process
+  if (!enableSnapshotSignal())
+    fprintf(stderr, "Couldn't install the SIGUSR2 heap snapshot handler\n");
+
+  if (profilePath != NULL && !startSampling(profilePath, profileFrequency)) {
+    fprintf(stderr, "Couldn't start the sampling profiler\n");
+    exit(70);
   }
 
+  if (path == NULL)
+    repl();
+  else
+    runFile(path);
+
   // Free
   freeVM();
   return 0;
-}
\ No newline at end of file
+}
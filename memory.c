@@ -1,24 +1,205 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "callprofile.h"
 #include "compiler.h"
+#include "gcstats.h"
+#include "heap.h"
 #include "memory.h"
 #include "object.h"
+#include "perfcounters.h"
+#include "probes.h"
+#include "timeline.h"
+#include "timer.h"
 #include "value.h"
 #include "vm.h"
 
-#ifdef DEBUG_LOG_GC
+#if defined(DEBUG_STRESS_GC) || defined(DEBUG_LOG_GC)
 #include "debug.h"
-#include <stdio.h>
 #endif
 
-void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
+GCConfig gcConfig = {
+    .mode = GC_STOP_THE_WORLD,
+    .nurserySize = 256 * 1024,
+    .stepSize = 64 * 1024,
+    .sliceNanos = 500 * 1000,
+    .markThreads = 1,
+    .sweepMode = SWEEP_EAGER,
+    .threshold = 1024 * 1024,
+    .growthFactor = 2.0,
+    .minHeap = 1024 * 1024,
+    .maxHeap = 0,
+    .compactThreshold = 0,
+    .heapLimit = 0,
+};
+
+// Parse a size in bytes with an optional k, m or g suffix
+static bool parseSize(const char *text, size_t *size) {
+  char *end;
+  double value = strtod(text, &end);
+  if (end == text || value < 0)
+    return false;
+
+  switch (*end) {
+  case 'k':
+  case 'K':
+    value *= 1024;
+    end++;
+    break;
+  case 'm':
+  case 'M':
+    value *= 1024 * 1024;
+    end++;
+    break;
+  case 'g':
+  case 'G':
+    value *= 1024 * 1024 * 1024;
+    end++;
+    break;
+  }
+  if (*end != '\0' || value >= (double)SIZE_MAX)
+    return false;
+
+  *size = (size_t)value;
+  return true;
+}
+
+bool setGCOption(const char *name, const char *value) {
+  if (strcmp(name, "gc") == 0) {
+    if (strcmp(value, "stw") == 0)
+      gcConfig.mode = GC_STOP_THE_WORLD;
+    else if (strcmp(value, "generational") == 0)
+      gcConfig.mode = GC_GENERATIONAL;
+    else if (strcmp(value, "incremental") == 0)
+      gcConfig.mode = GC_INCREMENTAL;
+    else if (strcmp(value, "concurrent") == 0)
+      gcConfig.mode = GC_CONCURRENT;
+    else
+      return false;
+    return true;
+  }
+  if (strcmp(name, "gc-growth") == 0) {
+    char *end;
+    double factor = strtod(value, &end);
+    // A factor of 1 or less would collect on every allocation
+    if (end == value || *end != '\0' || !(factor > 1.0))
+      return false;
+    gcConfig.growthFactor = factor;
+    return true;
+  }
+  if (strcmp(name, "gc-sweep") == 0) {
+    if (strcmp(value, "eager") == 0)
+      gcConfig.sweepMode = SWEEP_EAGER;
+    else if (strcmp(value, "lazy") == 0)
+      gcConfig.sweepMode = SWEEP_LAZY;
+    else if (strcmp(value, "background") == 0)
+      gcConfig.sweepMode = SWEEP_BACKGROUND;
+    else
+      return false;
+    return true;
+  }
+  if (strcmp(name, "gc-mark-threads") == 0) {
+    char *end;
+    long threads = strtol(value, &end, 10);
+    if (end == value || *end != '\0' || threads < 1 || threads > 256)
+      return false;
+    gcConfig.markThreads = (int)threads;
+    return true;
+  }
+  if (strcmp(name, "gc-compact") == 0) {
+    char *end;
+    double fraction = strtod(value, &end);
+    if (end == value || *end != '\0' || !(fraction >= 0) || fraction >= 1)
+      return false;
+    gcConfig.compactThreshold = fraction;
+    return true;
+  }
+  if (strcmp(name, "gc-slice") == 0) {
+    char *end;
+    double micros = strtod(value, &end);
+    if (end == value || *end != '\0' || !(micros >= 0) || micros > 1e9)
+      return false;
+    gcConfig.sliceNanos = (uint64_t)(micros * 1000);
+    return true;
+  }
+
+  size_t size;
+  if (!parseSize(value, &size))
+    return false;
+  if (strcmp(name, "gc-threshold") == 0 && size > 0)
+    gcConfig.threshold = size;
+  else if (strcmp(name, "gc-nursery") == 0 && size > 0)
+    gcConfig.nurserySize = size;
+  else if (strcmp(name, "gc-step") == 0 && size > 0)
+    gcConfig.stepSize = size;
+  else if (strcmp(name, "gc-min-heap") == 0)
+    gcConfig.minHeap = size;
+  else if (strcmp(name, "gc-max-heap") == 0)
+    gcConfig.maxHeap = size;
+  else if (strcmp(name, "heap-limit") == 0)
+    gcConfig.heapLimit = size;
+  else
+    return false;
+  return true;
+}
+
+// Heap size at which to collect next, given that "live" bytes survived
+static size_t nextThreshold(size_t live) {
+  double next = live * gcConfig.growthFactor;
+  if (next < gcConfig.minHeap)
+    next = gcConfig.minHeap;
+  if (gcConfig.maxHeap != 0 && next > gcConfig.maxHeap) {
+    next = gcConfig.maxHeap;
+    // Once the live data alone fills the maximum heap, keep some headroom so
+    // that not every allocation starts another collection
+    if (next < live + live / 8)
+      next = live + live / 8;
+  }
+  // Collect before reaching the limit rather than only once it is reached
+  if (gcConfig.heapLimit != 0 && next > gcConfig.heapLimit &&
+      live < gcConfig.heapLimit)
+    next = gcConfig.heapLimit;
+  return next < (double)SIZE_MAX ? (size_t)next : SIZE_MAX;
+}
+
+static void heapLimitReached();
+static void collectEmergency();
+
+// Count a change of an allocation from "oldSize" to "newSize" bytes towards the
+// heap size, collecting garbage if it grew past the next threshold
+static inline void countAllocation(size_t oldSize, size_t newSize) {
+  vm.bytesAllocated += newSize - oldSize;
   if (newSize > oldSize) {
+#ifdef PROFILE_CALLS
+    if (callProfilingEnabled)
+      profileAllocation(newSize - oldSize);
+#endif
     // Bad for performance but exposes any bugs since the GC is triggered at
     // every moment
 #ifdef DEBUG_STRESS_GC
-    collectGarbage();
+    if (debugFlags.stressGC)
+      collectGarbage();
 #endif
+    if (vm.bytesAllocated > vm.nextGC)
+      collectGarbage();
+    if (gcConfig.heapLimit != 0 && vm.bytesAllocated > gcConfig.heapLimit)
+      heapLimitReached();
   }
+}
+
+// Report that not even an emergency collection left enough memory to go on
+// with and quit. Only used where the program can't be stopped with a runtime
+// error instead
+static void outOfMemory() {
+  fprintf(stderr, "Out of memory\n");
+  exit(1);
+}
+
+void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
+  countAllocation(oldSize, newSize);
   // Free all space used and return null pointer if newSize is 0
   if (newSize == 0) {
     free(pointer);
@@ -27,34 +208,159 @@ void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
 
   // Resize array efficiently with realloc
   void *result = realloc(pointer, newSize);
-  // If there is no more memory left to allocate then exit early to prevent any
-  // weird behaviour
-  if (result == NULL)
-    exit(1);
+  // If there is no more memory left, free whatever is garbage and try again
+  if (result == NULL) {
+    collectEmergency();
+    result = realloc(pointer, newSize);
+    if (result == NULL)
+      outOfMemory();
+  }
   // Return pointer to reallocated array
   return result;
 }
 
+void *allocateObjectMemory(size_t size) {
+  countAllocation(0, size);
+  void *object = heapAllocate(size);
+  if (object == NULL) {
+    collectEmergency();
+    object = heapAllocate(size);
+    if (object == NULL)
+      outOfMemory();
+  }
+  return object;
+}
+
+void freeObjectMemory(void *object, size_t size) {
+  vm.bytesAllocated -= size;
+  heapFree(object, size);
+}
+
+// Append "object" to "*array", growing it with plain "realloc()" (a nested
+// collection must not start while the collector or a barrier is using it) but
+// counting the bytes towards the heap
+static void appendObject(Obj ***array, int *count, int *capacity,
+                         Obj *object) {
+  if (*capacity < *count + 1) {
+    int oldCapacity = *capacity;
+    *capacity = GROW_CAPACITY(oldCapacity);
+    *array = (Obj **)realloc(*array, sizeof(Obj *) * *capacity);
+
+    if (*array == NULL)
+      outOfMemory();
+    vm.bytesAllocated += sizeof(Obj *) * (*capacity - oldCapacity);
+  }
+
+  (*array)[(*count)++] = object;
+}
+
+bool gcThreadsMarking = false;
+
+/* Gray objects of a marking thread other than the main one:
+         - "count" is the number of objects on the stack
+         - "capacity" is the allocated size of "objects"
+         - "objects" is the stack itself
+   Unlike "vm.grayStack" its memory does not count towards the heap, since
+   only the main thread may update "vm.bytesAllocated"
+ */
+typedef struct {
+  int count;
+  int capacity;
+  Obj **objects;
+} GrayStack;
+
+// The gray stack of the marking thread this runs on, or NULL on the main
+// thread, which uses "vm.grayStack"
+static _Thread_local GrayStack *threadGray = NULL;
+
+// Serialises writes to closed upvalues by the main thread with reads of them
+// by marking threads (see "writeUpvalueLocked()")
+static pthread_mutex_t upvalueLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Make room for "count" more objects on "stack"
+static void reserveStack(GrayStack *stack, int count) {
+  if (stack->capacity >= stack->count + count)
+    return;
+  while (stack->capacity < stack->count + count)
+    stack->capacity = GROW_CAPACITY(stack->capacity);
+  stack->objects =
+      (Obj **)realloc(stack->objects, sizeof(Obj *) * stack->capacity);
+  if (stack->objects == NULL)
+    outOfMemory();
+}
+
+// Put the marked "object" on the current thread's gray stack
+static void pushGray(Obj *object) {
+  if (threadGray == NULL) {
+    appendObject(&vm.grayStack, &vm.grayCount, &vm.grayCapacity, object);
+    return;
+  }
+
+  reserveStack(threadGray, 1);
+  threadGray->objects[threadGray->count++] = object;
+}
+
 void markObject(Obj *object) {
-  if (object == NULL || object->isMarked)
+  if (object == NULL || heapIsMarked(object))
+    return;
+  // With other threads marking too, only the one that flips the mark bit
+  // gets to trace the object
+  if (heapMark(object))
     return;
 #ifdef DEBUG_LOG_GC
-  printf("%p mark ", (void *)object);
-  printValue(OBJ_VAL(object));
-  printf("\n");
+  if (debugFlags.logGC) {
+    printf("%p mark ", (void *)object);
+    printValue(OBJ_VAL(object));
+    printf("\n");
+  }
 #endif
-  object->isMarked = true;
-
-  if (vm.grayCapacity < vm.grayCount + 1) {
-    vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
-    vm.grayStack =
-        (Obj **)realloc(vm.grayStack, sizeof(Obj *) * vm.grayCapacity);
+  pushGray(object);
+}
 
-    if (vm.grayStack == NULL)
-      exit(1);
+void rescanObject(Obj *object) {
+  if (!heapIsMarked(object)) {
+    markObject(object);
+    return;
   }
+  pushGray(object);
+}
+
+// Add "object" to the remembered set, which the generational collector treats
+// as roots when it collects the nursery
+static void rememberObject(Obj *object) {
+  setRemembered(object, true);
+  appendObject(&vm.remembered, &vm.rememberedCount, &vm.rememberedCapacity,
+               object);
+}
 
-  vm.grayStack[vm.grayCount++] = object;
+void writeBarrierSlow(Obj *object, Value value) {
+  if (gcConfig.mode == GC_GENERATIONAL) {
+    if (!isRemembered(object))
+      rememberObject(object);
+  } else if (vm.gcMarking)
+    // The object may have been traced already, so shade the value instead
+    markValue(value);
+}
+
+void writeUpvalueLocked(ObjUpvalue *upvalue, Value value) {
+  pthread_mutex_lock(&upvalueLock);
+  Value old = upvalue->closed;
+  upvalue->closed = value;
+  pthread_mutex_unlock(&upvalueLock);
+  // Snapshot at the beginning: whatever the upvalue held when marking started
+  // must be marked, even if the marking thread had not got to it yet
+  markValue(old);
+  markValue(value);
+}
+
+void objectChanged(Obj *object) {
+  if (!heapIsMarked(object))
+    return;
+  if (gcConfig.mode == GC_GENERATIONAL) {
+    if (!isRemembered(object))
+      rememberObject(object);
+  } else if (vm.gcMarking)
+    rescanObject(object);
 }
 
 void markValue(Value value) {
@@ -70,12 +376,14 @@ static void markArray(ValueArray *array) {
 
 static void blackenObject(Obj *object) {
 #ifdef DEBUG_LOG_GC
-  printf("%p blacken ", (void *)object);
-  printValue(OBJ_VAL(object));
-  printf("\n");
+  if (debugFlags.logGC) {
+    printf("%p blacken ", (void *)object);
+    printValue(OBJ_VAL(object));
+    printf("\n");
+  }
 #endif
 
-  switch (object->type) {
+  switch (objType(object)) {
   case OBJ_CLOSURE: {
     ObjClosure *closure = (ObjClosure *)object;
     markObject((Obj *)closure->function);
@@ -90,49 +398,81 @@ static void blackenObject(Obj *object) {
     markArray(&function->chunk.constants);
     break;
   }
-  case OBJ_UPVALUE:
-    markValue(((ObjUpvalue *)object)->closed);
+  case OBJ_UPVALUE: {
+    ObjUpvalue *upvalue = (ObjUpvalue *)object;
+    // The main thread may be closing or assigning the upvalue right now
+    if (threadGray != NULL) {
+      pthread_mutex_lock(&upvalueLock);
+      Value closed = upvalue->closed;
+      pthread_mutex_unlock(&upvalueLock);
+      markValue(closed);
+    } else
+      markValue(upvalue->closed);
     break;
+  }
   case OBJ_NATIVE:
   case OBJ_STRING:
     break;
   }
 }
 
+size_t objectSize(Obj *object) {
+  switch (objType(object)) {
+  case OBJ_CLOSURE:
+    return sizeof(ObjClosure) +
+           sizeof(ObjUpvalue *) * ((ObjClosure *)object)->upvalueCount;
+  case OBJ_FUNCTION: {
+    Chunk *chunk = &((ObjFunction *)object)->chunk;
+    return sizeof(ObjFunction) +
+           (sizeof(uint8_t) + sizeof(int)) * chunk->capacity +
+           sizeof(Value) * chunk->constants.capacity;
+  }
+  case OBJ_NATIVE:
+    return sizeof(ObjNative);
+  case OBJ_STRING:
+    return sizeof(ObjString) + ((ObjString *)object)->length + 1;
+  case OBJ_UPVALUE:
+    return sizeof(ObjUpvalue);
+  }
+  return 0;
+}
+
 static void freeObject(Obj *object) {
 #ifdef DEBUG_LOG_GC
-  printf("%p free type %d\n", (void *)object, object->type);
+  if (debugFlags.logGC)
+    printf("%p free type %d\n", (void *)object, objType(object));
 #endif
-  switch (object->type) {
+  switch (objType(object)) {
   case OBJ_CLOSURE: {
     ObjClosure *closure = (ObjClosure *)object;
     FREE_ARRAY(ObjUpvalue *, closure->upvalues, closure->upvalueCount);
-    FREE(ObjClosure, object);
+    FREE_OBJ(ObjClosure, object);
     break;
   }
   case OBJ_FUNCTION: {
     ObjFunction *function = (ObjFunction *)object;
     freeChunk(&function->chunk);
-    FREE(ObjFunction, object);
+    FREE_OBJ(ObjFunction, object);
     break;
   }
   case OBJ_NATIVE:
-    FREE(ObjNative, object);
+    FREE_OBJ(ObjNative, object);
     break;
-  case OBJ_STRING: {
-    ObjString *string = (ObjString *)object;
-    FREE_ARRAY(char, string->chars, string->length + 1);
-    // FREE instead of free to help the VM track memory usage
-    FREE(ObjString, object);
+  case OBJ_STRING:
+    // The characters are part of the object
+    freeObjectMemory(object,
+                     sizeof(ObjString) + ((ObjString *)object)->length + 1);
     break;
-  }
   case OBJ_UPVALUE:
-    FREE(ObjUpvalue, object);
+    FREE_OBJ(ObjUpvalue, object);
     break;
   }
 }
 
-static void markRoots() {
+// Mark the roots that the mutator changes without going through a write
+// barrier: the value stack, the call frames, the open upvalues and the
+// functions being compiled
+static void markStackRoots() {
   for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
     markValue(*slot);
   }
@@ -146,60 +486,1036 @@ static void markRoots() {
     markObject((Obj *)upvalue);
   }
 
-  markTable(&vm.globals);
   markCompilerRoots();
 }
 
+// Mark the roots. A minor collection skips the globals unless an old object has
+// been stored in them, and adds the remembered set instead
+static void markRoots(bool minor) {
+  markStackRoots();
+
+  if (!minor || vm.globalsRemembered)
+    markTable(&vm.globals);
+  vm.globalsRemembered = false;
+
+  // Old objects that were made to refer to young ones. A full collection
+  // traces them anyway
+  for (int i = 0; i < vm.rememberedCount; i++) {
+    setRemembered(vm.remembered[i], false);
+    if (minor)
+      rescanObject(vm.remembered[i]);
+  }
+  vm.rememberedCount = 0;
+}
+
+/* A marking thread of parallel marking:
+         - "local" is its own gray stack, which only it uses
+         - "shared" holds gray objects it has given up for others to steal,
+   guarded by "lock"
+ */
+typedef struct {
+  GrayStack local;
+  GrayStack shared;
+  pthread_mutex_t lock;
+} MarkWorker;
+
+// The workers of parallel marking. The thread that starts the marking is
+// worker 0, the others are helper threads that wait for "poolEpoch" to change
+// and report back through "poolBusy" once there is nothing left to mark
+static MarkWorker *workers = NULL;
+static pthread_t *helpers = NULL;
+static int workerCount = 0;
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t poolWake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t poolDone = PTHREAD_COND_INITIALIZER;
+static unsigned long poolEpoch = 0;
+static int poolBusy = 0;
+static bool poolStopping = false;
+// Number of workers that found nothing to mark or steal
+static int idleWorkers = 0;
+
+static int sharedCount(MarkWorker *worker) {
+  return __atomic_load_n(&worker->shared.count, __ATOMIC_ACQUIRE);
+}
+
+// Move the top half of "from" onto "to". The counts are stored atomically
+// since other workers peek at those of shared stacks without the lock
+static void moveHalf(GrayStack *from, GrayStack *to) {
+  int moved = (from->count + 1) / 2;
+  reserveStack(to, moved);
+  memcpy(to->objects + to->count, from->objects + from->count - moved,
+         sizeof(Obj *) * moved);
+  __atomic_store_n(&to->count, to->count + moved, __ATOMIC_RELEASE);
+  __atomic_store_n(&from->count, from->count - moved, __ATOMIC_RELEASE);
+}
+
+// Give some of "worker"'s gray objects to the idle workers
+static void shareWork(MarkWorker *worker) {
+  pthread_mutex_lock(&worker->lock);
+  moveHalf(&worker->local, &worker->shared);
+  pthread_mutex_unlock(&worker->lock);
+}
+
+// Take gray objects shared by any worker (its own first) onto the local stack
+// of worker "index", and return whether there were any
+static bool stealWork(int index) {
+  MarkWorker *self = &workers[index];
+  for (int i = 0; i < workerCount; i++) {
+    MarkWorker *victim = &workers[(index + i) % workerCount];
+    if (sharedCount(victim) == 0)
+      continue;
+
+    pthread_mutex_lock(&victim->lock);
+    int count = victim->shared.count;
+    if (count > 0)
+      moveHalf(&victim->shared, &self->local);
+    pthread_mutex_unlock(&victim->lock);
+    if (count > 0)
+      return true;
+  }
+  return false;
+}
+
+static bool anyShared() {
+  for (int i = 0; i < workerCount; i++)
+    if (sharedCount(&workers[i]) > 0)
+      return true;
+  return false;
+}
+
+// Mark as worker "index" until no worker has anything left to mark. A worker
+// only counts as idle while it has nothing on its stacks, so once all of them
+// are idle there is no work anywhere
+static void markAsWorker(int index) {
+  MarkWorker *self = &workers[index];
+  GrayStack *previous = threadGray;
+  threadGray = &self->local;
+
+  for (;;) {
+    while (self->local.count > 0) {
+      blackenObject(self->local.objects[--self->local.count]);
+      if (self->local.count > 1 && sharedCount(self) == 0 &&
+          __atomic_load_n(&idleWorkers, __ATOMIC_RELAXED) > 0)
+        shareWork(self);
+    }
+    if (stealWork(index))
+      continue;
+
+    __atomic_add_fetch(&idleWorkers, 1, __ATOMIC_ACQ_REL);
+    for (;;) {
+      if (__atomic_load_n(&idleWorkers, __ATOMIC_ACQUIRE) == workerCount) {
+        threadGray = previous;
+        return;
+      }
+      if (anyShared()) {
+        __atomic_sub_fetch(&idleWorkers, 1, __ATOMIC_ACQ_REL);
+        break;
+      }
+      sched_yield();
+    }
+  }
+}
+
+static void *runHelper(void *argument) {
+  int index = (int)(intptr_t)argument;
+  unsigned long seen = 0;
+
+  pthread_mutex_lock(&poolLock);
+  for (;;) {
+    while (poolEpoch == seen && !poolStopping)
+      pthread_cond_wait(&poolWake, &poolLock);
+    if (poolStopping)
+      break;
+    seen = poolEpoch;
+    pthread_mutex_unlock(&poolLock);
+
+    markAsWorker(index);
+
+    pthread_mutex_lock(&poolLock);
+    if (--poolBusy == 0)
+      pthread_cond_signal(&poolDone);
+  }
+  pthread_mutex_unlock(&poolLock);
+  return NULL;
+}
+
+// Start the helper threads for "gcConfig.markThreads" workers. If some cannot
+// be created, mark with fewer
+static void startWorkers() {
+  int count = gcConfig.markThreads;
+  workers = (MarkWorker *)calloc(count, sizeof(MarkWorker));
+  helpers = (pthread_t *)calloc(count, sizeof(pthread_t));
+  if (workers == NULL || helpers == NULL)
+    outOfMemory();
+  for (int i = 0; i < count; i++)
+    pthread_mutex_init(&workers[i].lock, NULL);
+
+  poolStopping = false;
+  workerCount = 1;
+  while (workerCount < count &&
+         pthread_create(&helpers[workerCount - 1], NULL, runHelper,
+                        (void *)(intptr_t)workerCount) == 0)
+    workerCount++;
+}
+
+static void stopWorkers() {
+  if (workers == NULL)
+    return;
+
+  pthread_mutex_lock(&poolLock);
+  poolStopping = true;
+  pthread_cond_broadcast(&poolWake);
+  pthread_mutex_unlock(&poolLock);
+  for (int i = 0; i < workerCount - 1; i++)
+    pthread_join(helpers[i], NULL);
+
+  for (int i = 0; i < gcConfig.markThreads; i++) {
+    free(workers[i].local.objects);
+    free(workers[i].shared.objects);
+    pthread_mutex_destroy(&workers[i].lock);
+  }
+  free(workers);
+  free(helpers);
+  workers = NULL;
+  helpers = NULL;
+  workerCount = 0;
+}
+
+// Blacken the "*count" gray objects in "objects" and everything reachable from
+// them with all workers, the calling thread being one of them
+static void traceInParallel(Obj **objects, int *count) {
+  if (workers == NULL)
+    startWorkers();
+
+  for (int i = 0; i < *count; i++) {
+    GrayStack *stack = &workers[i % workerCount].local;
+    reserveStack(stack, 1);
+    stack->objects[stack->count++] = objects[i];
+  }
+  *count = 0;
+
+  // In concurrent mode this runs on the marking thread, which already marks
+  // atomically
+  if (!gcThreadsMarking)
+    gcThreadsMarking = true;
+  idleWorkers = 0;
+
+  pthread_mutex_lock(&poolLock);
+  poolBusy = workerCount - 1;
+  poolEpoch++;
+  pthread_cond_broadcast(&poolWake);
+  pthread_mutex_unlock(&poolLock);
+
+  markAsWorker(0);
+
+  pthread_mutex_lock(&poolLock);
+  while (poolBusy > 0)
+    pthread_cond_wait(&poolDone, &poolLock);
+  pthread_mutex_unlock(&poolLock);
+}
+
 static void traceReferences() {
+  if (gcConfig.markThreads > 1 && vm.grayCount > 0) {
+    bool wasMarking = gcThreadsMarking;
+    traceInParallel(vm.grayStack, &vm.grayCount);
+    gcThreadsMarking = wasMarking;
+    return;
+  }
+
   while (vm.grayCount > 0) {
     Obj *object = vm.grayStack[--vm.grayCount];
     blackenObject(object);
   }
 }
 
-// Free all unreachable (unmarked) objects
-static void sweep() {
+// Blacken gray objects until there are none left or "deadline" has passed, and
+// return whether there are none left. The clock is only read every few objects
+static bool traceUntil(uint64_t deadline) {
+  int traced = 0;
+  while (vm.grayCount > 0) {
+    Obj *object = vm.grayStack[--vm.grayCount];
+    blackenObject(object);
+    if (++traced % 16 == 0 && monotonicNanos() >= deadline)
+      break;
+  }
+  return vm.grayCount == 0;
+}
+
+// Free all unreachable (unmarked) objects from the start of "vm.objects" up to
+// (but not including) "end" and return how many there were. In generational
+// mode the survivors stay marked, which makes them old
+static size_t sweep(Obj *end) {
+  bool keepMarks = gcConfig.mode == GC_GENERATIONAL;
+  size_t freed = 0;
   Obj *previous = NULL;
   Obj *object = vm.objects;
-  while (object != NULL) {
-    if (object->isMarked) {
-      object->isMarked = false;
+  while (object != end) {
+    if (heapIsMarked(object)) {
+      if (!keepMarks)
+        heapClearMark(object);
       previous = object;
-      object = object->next;
+      object = objNext(object);
     } else {
       Obj *unreached = object;
-      object = object->next;
+      object = objNext(object);
       if (previous != NULL)
-        previous->next = object;
+        setObjNext(previous, object);
       else
         vm.objects = object;
 
       freeObject(unreached);
+      freed++;
     }
   }
+  return freed;
 }
 
-void collectGarbage() {
+// Size of the struct of "object" (with the characters of a string), which its
+// heap cell was allocated for
+static size_t structSize(Obj *object) {
+  switch (objType(object)) {
+  case OBJ_CLOSURE:
+    return sizeof(ObjClosure);
+  case OBJ_FUNCTION:
+    return sizeof(ObjFunction);
+  case OBJ_NATIVE:
+    return sizeof(ObjNative);
+  case OBJ_STRING:
+    return sizeof(ObjString) + ((ObjString *)object)->length + 1;
+  case OBJ_UPVALUE:
+    return sizeof(ObjUpvalue);
+  }
+  return 0;
+}
+
+// Free "object" with plain "free()" and "heapFree()", leaving
+// "vm.bytesAllocated" alone, for the sweeping thread
+static void releaseObject(Obj *object) {
+  switch (objType(object)) {
+  case OBJ_CLOSURE:
+    free(((ObjClosure *)object)->upvalues);
+    break;
+  case OBJ_FUNCTION: {
+    Chunk *chunk = &((ObjFunction *)object)->chunk;
+    free(chunk->code);
+    free(chunk->lines);
+    free(chunk->constants.values);
+    break;
+  }
+  case OBJ_NATIVE:
+  case OBJ_STRING:
+  case OBJ_UPVALUE:
+    break;
+  }
+  heapFree(object, structSize(object));
+}
+
+// Ask for a compaction at the next safepoint if the collection that just
+// finished left too many pages only sparsely used
+static void considerCompaction() {
+  if (gcConfig.compactThreshold == 0)
+    return;
+  bool fragmented = heapFragmentation() > gcConfig.compactThreshold;
+#ifdef DEBUG_STRESS_GC
+  // Move objects as often as possible to expose missed references
+  if (debugFlags.stressGC)
+    fragmented = true;
+#endif
+  if (fragmented) {
+    vm.compactRequested = true;
+    __atomic_store_n(&vm.safepointRequested, 1, __ATOMIC_RELAXED);
+  }
+}
+
+// Whether the collection whose marking just ended will leave the heap
+// fragmented enough to compact it, going by the mark bits
+static bool compactionWanted() {
+  if (gcConfig.compactThreshold == 0)
+    return false;
+#ifdef DEBUG_STRESS_GC
+  // As in "considerCompaction()"
+  if (debugFlags.stressGC)
+    return true;
+#endif
+  return heapFragmentationOfMarked() > gcConfig.compactThreshold;
+}
+
+/* State of a lazy or background sweep, which takes the objects that were
+   there when marking ended off "vm.objects" so that new ones can be added in
+   the meantime:
+         - "sweeping" is whether one is in progress
+         - "unswept" is the list of objects still to be swept
+         - "swept" is the list of survivors, and "sweptLast" its last one
+         - "sweptBytes" and "sweptObjects" count what has been freed
+         - "sweepLimit" is the heap size at which the program waits for the
+   sweeping thread
+ */
+static bool sweeping = false;
+static Obj *unswept = NULL;
+static Obj *swept = NULL;
+static Obj *sweptLast = NULL;
+static size_t sweptBytes = 0;
+static size_t sweptObjects = 0;
+static size_t sweepLimit = 0;
+
+static pthread_t sweeperThread;
+static bool sweeperRunning = false;
+static bool sweeperDone = false;
+
+// Add the survivor "object" to the end of "swept"
+static void appendSwept(Obj *object) {
+  if (sweptLast == NULL)
+    swept = object;
+  else
+    setObjNext(sweptLast, object);
+  sweptLast = object;
+}
+
+// Sweep objects from "unswept" until "budget" bytes worth of them have been
+// looked at, and return whether it is empty
+static bool sweepSome(size_t budget) {
+  size_t seen = 0;
+  while (unswept != NULL && seen < budget) {
+    Obj *object = unswept;
+    unswept = objNext(object);
+    size_t size = objectSize(object);
+    seen += size;
+
+    if (heapIsMarked(object)) {
+      heapClearMark(object);
+      appendSwept(object);
+    } else {
+      freeObject(object);
+      sweptBytes += size;
+      sweptObjects++;
+    }
+  }
+  if (sweptLast != NULL)
+    setObjNext(sweptLast, NULL);
+  return unswept == NULL;
+}
+
+static void *sweepConcurrently(void *unused) {
+  while (unswept != NULL) {
+    Obj *object = unswept;
+    unswept = objNext(object);
+
+    if (heapIsMarked(object)) {
+      heapClearMark(object);
+      appendSwept(object);
+    } else {
+      sweptBytes += objectSize(object);
+      sweptObjects++;
+      releaseObject(object);
+    }
+  }
+  if (sweptLast != NULL)
+    setObjNext(sweptLast, NULL);
+
+  __atomic_store_n(&sweeperDone, true, __ATOMIC_RELEASE);
+  // Have the main thread finish the collection at its next safepoint
+  __atomic_store_n(&vm.gcSliceRequested, true, __ATOMIC_RELEASE);
+  __atomic_store_n(&vm.safepointRequested, 1, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+// Take every object off "vm.objects" to be swept lazily or on the sweeping
+// thread. Called at the end of a pause, once the mark bits are final
+static void beginSweeping() {
+  sweeping = true;
+  unswept = vm.objects;
+  vm.objects = NULL;
+  swept = NULL;
+  sweptLast = NULL;
+  sweptBytes = 0;
+  sweptObjects = 0;
+  // What is still unswept counts as live until it has been swept
+  sweepLimit = nextThreshold(vm.bytesAllocated);
+  vm.nextGC = vm.bytesAllocated + gcConfig.stepSize;
+
+  // If the thread cannot be created, the objects are swept lazily instead
+  if (gcConfig.sweepMode == SWEEP_BACKGROUND) {
+    sweeperDone = false;
+    setHeapShared(true);
+    sweeperRunning =
+        pthread_create(&sweeperThread, NULL, sweepConcurrently, NULL) == 0;
+    if (!sweeperRunning)
+      setHeapShared(false);
+  }
+}
+
+// Wait for the sweeping thread to be done with "unswept", leaving the rest of
+// the sweep to be finished as a lazy one
+static void joinSweeper() {
+  pthread_join(sweeperThread, NULL);
+  sweeperRunning = false;
+  setHeapShared(false);
+  vm.bytesAllocated -= sweptBytes;
+}
+
+void sweepInProgress(Obj **toSweep, Obj **survivors) {
+  if (sweeperRunning)
+    joinSweeper();
+  *toSweep = sweeping ? unswept : NULL;
+  *survivors = sweeping ? swept : NULL;
+}
+
+void finishSweeping() {
+  if (!sweeping)
+    return;
+
+  if (sweeperRunning)
+    joinSweeper();
+  else
+    sweepSome(SIZE_MAX);
+
+  // Put the survivors behind the objects allocated while sweeping
+  if (vm.objects == NULL)
+    vm.objects = swept;
+  else {
+    Obj *last = vm.objects;
+    while (objNext(last) != NULL)
+      last = objNext(last);
+    setObjNext(last, swept);
+  }
+  swept = NULL;
+  sweptLast = NULL;
+  sweeping = false;
+  releaseEmptyPages();
+  considerCompaction();
+
+  vm.nextGC = nextThreshold(vm.bytesAllocated);
 #ifdef DEBUG_LOG_GC
-  printf("-- gc begin\n");
+  if (debugFlags.logGC)
+    printf("   swept %zu bytes, heap now %zu, next at %zu\n", sweptBytes,
+           vm.bytesAllocated, vm.nextGC);
 #endif
-  markRoots();
-  traceReferences();
+  recordCollection(sweptBytes, sweptObjects, false);
+}
+
+// Start a pause of the mutator called "name" and return its start time
+static uint64_t beginPause(const char *name) {
+  uint64_t start = monotonicNanos();
+  PROBE0(gc__begin);
+#ifdef DEBUG_LOG_GC
+  if (debugFlags.logGC)
+    printf("-- gc begin %s\n", name);
+#endif
+  if (perfCountersEnabled)
+    perfPhaseBegin(PERF_GC);
+  if (timelineEnabled)
+    timelineBegin("gc", name);
+  return start;
+}
+
+static void endPause(const char *name, uint64_t start) {
+  if (timelineEnabled)
+    timelineEnd("gc", name, NULL);
+  if (perfCountersEnabled)
+    perfPhaseEnd();
+  PROBE0(gc__end);
+#ifdef DEBUG_LOG_GC
+  if (debugFlags.logGC)
+    printf("-- gc end %s\n", name);
+#endif
+  recordPause(monotonicNanos() - start);
+}
+
+// Once marking is complete, drop the unmarked strings from the intern table,
+// free every unmarked object and work out when to collect next
+static void reclaim(bool minor) {
+  size_t before = vm.bytesAllocated;
+  if (timelineEnabled)
+    timelineBegin("gc", "tableRemoveWhite");
   tableRemoveWhite(&vm.strings);
-  sweep();
+  if (timelineEnabled)
+    timelineEnd("gc", "tableRemoveWhite", NULL);
+
+  // The generational collector keeps the old objects after the young ones in
+  // "vm.objects", so it always sweeps right away. So does a collection that
+  // leaves enough pages sparse to compact them: swept lazily, the program
+  // would fill the freed cells again before the compaction could see them
+  if (gcConfig.sweepMode != SWEEP_EAGER && gcConfig.mode != GC_GENERATIONAL &&
+      !compactionWanted()) {
+    beginSweeping();
+    return;
+  }
+
+  if (timelineEnabled)
+    timelineBegin("gc", "sweep");
+  // Young objects sit at the start of "vm.objects" (objects are added at the
+  // front) up to "vm.firstOld", so a minor collection only sweeps that part
+  size_t objectsFreed = sweep(minor ? vm.firstOld : NULL);
+  size_t bytesFreed = before - vm.bytesAllocated;
+  releaseEmptyPages();
+  considerCompaction();
+  if (timelineEnabled)
+    timelineEnd("gc", "sweep", NULL);
+
+  if (gcConfig.mode == GC_GENERATIONAL) {
+    // Every survivor is old now
+    vm.firstOld = vm.objects;
+    if (!minor)
+      vm.nextFullGC = nextThreshold(vm.bytesAllocated);
+    vm.nextGC = vm.bytesAllocated + gcConfig.nurserySize;
+    if (vm.nextGC > vm.nextFullGC)
+      vm.nextGC = vm.nextFullGC;
+  } else
+    vm.nextGC = nextThreshold(vm.bytesAllocated);
+
 #ifdef DEBUG_LOG_GC
-  printf("-- gc end\n");
+  if (debugFlags.logGC)
+    printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
+           before - vm.bytesAllocated, before, vm.bytesAllocated, vm.nextGC);
 #endif
+  recordCollection(bytesFreed, objectsFreed, minor);
+}
+
+// Move a lazy or background sweep along: sweep the next few objects (or check
+// whether the sweeping thread is done) and finish once nothing is left. If the
+// heap outgrows "sweepLimit" first, wait for the sweeping thread
+static void continueSweeping() {
+  if (sweeperRunning) {
+    if (!__atomic_load_n(&sweeperDone, __ATOMIC_ACQUIRE) &&
+        vm.bytesAllocated <= sweepLimit) {
+      vm.nextGC = vm.bytesAllocated + gcConfig.stepSize;
+      return;
+    }
+    uint64_t start = beginPause("finishSweeping");
+    finishSweeping();
+    endPause("finishSweeping", start);
+    return;
+  }
+
+  uint64_t start = beginPause("sweep");
+  if (sweepSome(gcConfig.stepSize))
+    finishSweeping();
+  else
+    vm.nextGC = vm.bytesAllocated + gcConfig.stepSize;
+  endPause("sweep", start);
+}
+
+// Remark the roots that have no write barriers, finish tracing and reclaim.
+// Called inside a pause once the gray stack of an incremental cycle has
+// drained (or has to be drained right away)
+static void finishMarking() {
+  markStackRoots();
+  traceReferences();
+  vm.gcMarking = false;
+  reclaim(false);
+}
+
+// Collect in incremental mode: start a marking cycle by graying the roots, or
+// if one is running already ask "run()" for another slice of it. If the heap
+// has grown too much since the cycle started, finish it immediately instead
+static void advanceIncremental() {
+  if (!vm.gcMarking) {
+    uint64_t start = beginPause("markRoots");
+    markRoots(false);
+    vm.gcMarking = true;
+    // The heap size at which the cycle is finished without waiting for slices
+    vm.nextFullGC = nextThreshold(vm.bytesAllocated);
+    endPause("markRoots", start);
+  } else if (vm.bytesAllocated > vm.nextFullGC) {
+    uint64_t start = beginPause("finishMarking");
+    finishMarking();
+    endPause("finishMarking", start);
+    return;
+  }
+
+  vm.nextGC = vm.bytesAllocated + gcConfig.stepSize;
+  if (vm.nextGC > vm.nextFullGC)
+    vm.nextGC = vm.nextFullGC;
+  vm.gcSliceRequested = true;
+  vm.safepointRequested = 1;
+}
+
+// The thread marking in concurrent mode, its gray stack and whether it has
+// run out of objects to mark
+static pthread_t markerThread;
+static bool markerRunning = false;
+static GrayStack markerGray;
+static bool markerDone;
+
+// Blacken everything on "markerGray" on the current thread (and the helper
+// threads of parallel marking)
+static void drainMarkerGray() {
+  if (gcConfig.markThreads > 1) {
+    traceInParallel(markerGray.objects, &markerGray.count);
+    return;
+  }
+
+  GrayStack *previous = threadGray;
+  threadGray = &markerGray;
+  while (markerGray.count > 0)
+    blackenObject(markerGray.objects[--markerGray.count]);
+  threadGray = previous;
+}
+
+static void *markConcurrently(void *unused) {
+  drainMarkerGray();
+  __atomic_store_n(&markerDone, true, __ATOMIC_RELEASE);
+  // Have the main thread finish the collection at its next safepoint
+  __atomic_store_n(&vm.gcSliceRequested, true, __ATOMIC_RELEASE);
+  __atomic_store_n(&vm.safepointRequested, 1, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+// Wait for the marking thread, then trace what the main thread shaded in the
+// meantime (which needs no remark of the roots thanks to the snapshot at the
+// beginning) and reclaim
+static void finishConcurrentMarking() {
+  if (markerRunning) {
+    pthread_join(markerThread, NULL);
+    markerRunning = false;
+  }
+  gcThreadsMarking = false;
+  free(markerGray.objects);
+  markerGray.objects = NULL;
+  markerGray.capacity = 0;
+
+  traceReferences();
+  vm.gcMarking = false;
+  reclaim(false);
+}
+
+// Take a snapshot of the roots by marking them and hand them to a new marking
+// thread. Only called at a safepoint, so nothing is being compiled and every
+// function reachable from the roots is complete
+static void startConcurrentMarking() {
+  uint64_t start = beginPause("markRoots");
+  markRoots(false);
+
+  // The marked roots become the marking thread's gray stack
+  markerGray.count = vm.grayCount;
+  markerGray.capacity = vm.grayCapacity;
+  markerGray.objects = vm.grayStack;
+  vm.bytesAllocated -= sizeof(Obj *) * vm.grayCapacity;
+  vm.grayCount = 0;
+  vm.grayCapacity = 0;
+  vm.grayStack = NULL;
+
+  vm.gcMarking = true;
+  markerDone = false;
+  gcThreadsMarking = true;
+  markerRunning =
+      pthread_create(&markerThread, NULL, markConcurrently, NULL) == 0;
+  if (!markerRunning) {
+    // No thread to mark on, so do all of it in this pause
+    drainMarkerGray();
+    finishConcurrentMarking();
+  }
+  endPause("markRoots", start);
+}
+
+// Collect in concurrent mode: ask for a marking thread to be started at the
+// next safepoint, or finish the running one if the heap has grown too much to
+// wait for it. If no safepoint came (e.g. while compiling) and the heap keeps
+// growing, collect without a thread instead
+static void advanceConcurrent() {
+  if (vm.gcMarking && vm.bytesAllocated > vm.nextFullGC) {
+    uint64_t start = beginPause("finishMarking");
+    finishConcurrentMarking();
+    endPause("finishMarking", start);
+    return;
+  }
+  if (!vm.gcMarking) {
+    if (!vm.gcSliceRequested)
+      // The heap size at which marking is not waited for any longer
+      vm.nextFullGC = nextThreshold(vm.bytesAllocated);
+    else if (vm.bytesAllocated > vm.nextFullGC) {
+      vm.gcSliceRequested = false;
+      uint64_t start = beginPause("collectGarbage");
+      markRoots(false);
+      traceReferences();
+      reclaim(false);
+      endPause("collectGarbage", start);
+      return;
+    }
+    vm.gcSliceRequested = true;
+    vm.safepointRequested = 1;
+  }
+
+  vm.nextGC = vm.bytesAllocated + gcConfig.stepSize;
+  if (vm.nextGC > vm.nextFullGC)
+    vm.nextGC = vm.nextFullGC;
+}
+
+void collectGarbageSlice() {
+  // Marking and sweeping threads set this as well
+  __atomic_store_n(&vm.gcSliceRequested, false, __ATOMIC_RELAXED);
+
+  // Only the sweeping thread asks for a slice while sweeping
+  if (sweeping) {
+    if (sweeperRunning && __atomic_load_n(&sweeperDone, __ATOMIC_ACQUIRE)) {
+      uint64_t start = beginPause("finishSweeping");
+      finishSweeping();
+      endPause("finishSweeping", start);
+    }
+    return;
+  }
+
+  if (gcConfig.mode == GC_CONCURRENT) {
+    if (!vm.gcMarking)
+      startConcurrentMarking();
+    else if (__atomic_load_n(&markerDone, __ATOMIC_ACQUIRE)) {
+      uint64_t start = beginPause("finishMarking");
+      finishConcurrentMarking();
+      endPause("finishMarking", start);
+    }
+    return;
+  }
+
+  if (!vm.gcMarking)
+    return;
+
+  uint64_t start = beginPause("markSlice");
+  if (traceUntil(start + gcConfig.sliceNanos))
+    finishMarking();
+  endPause("markSlice", start);
+}
+
+void collectGarbage() {
+  // The next collection needs the mark bits cleared by the sweep
+  if (sweeping) {
+    continueSweeping();
+    return;
+  }
+  if (gcConfig.mode == GC_INCREMENTAL) {
+    advanceIncremental();
+    return;
+  }
+  if (gcConfig.mode == GC_CONCURRENT) {
+    advanceConcurrent();
+    return;
+  }
+
+  bool minor = gcConfig.mode == GC_GENERATIONAL &&
+               vm.bytesAllocated <= vm.nextFullGC;
+  const char *name = minor ? "minorCollection" : "collectGarbage";
+  uint64_t start = beginPause(name);
+  // Old objects are marked, so a full collection unmarks them first
+  if (gcConfig.mode == GC_GENERATIONAL && !minor)
+    for (Obj *object = vm.firstOld; object != NULL; object = objNext(object))
+      heapClearMark(object);
+
+  if (timelineEnabled)
+    timelineBegin("gc", "mark");
+  markRoots(minor);
+  traceReferences();
+  if (timelineEnabled)
+    timelineEnd("gc", "mark", NULL);
+  reclaim(minor);
+  endPause(name, start);
+}
+
+// Collect everything that is unreachable right now, whatever the mode: finish
+// the cycle in progress, then mark from the roots and sweep in one pause
+// called "name"
+static void collectEverything(const char *name) {
+  uint64_t start = beginPause(name);
+  if (vm.gcMarking) {
+    if (gcConfig.mode == GC_CONCURRENT)
+      finishConcurrentMarking();
+    else
+      finishMarking();
+  }
+  finishSweeping();
+
+  if (gcConfig.mode == GC_GENERATIONAL)
+    for (Obj *object = vm.firstOld; object != NULL; object = objNext(object))
+      heapClearMark(object);
+  markRoots(false);
+  traceReferences();
+  reclaim(false);
+  finishSweeping();
+  endPause(name, start);
+}
+
+static void collectEmergency() { collectEverything("emergencyCollection"); }
+
+void collectAllGarbage() { collectEverything("fullCollection"); }
+
+// The heap has grown past "gcConfig.heapLimit". Collect all the garbage there
+// is, and if that doesn't bring it back under the limit have "run()" stop the
+// program with an error at its next safepoint
+static void heapLimitReached() {
+  // Until then the program may allocate a little more without collecting
+  // over and over
+  if (vm.heapExhausted)
+    return;
+  collectEmergency();
+  if (vm.bytesAllocated > gcConfig.heapLimit) {
+    vm.heapExhausted = true;
+    __atomic_store_n(&vm.safepointRequested, 1, __ATOMIC_RELAXED);
+  }
+}
+
+bool reserveHeap(size_t bytes) {
+  if (gcConfig.heapLimit == 0 ||
+      vm.bytesAllocated + bytes <= gcConfig.heapLimit)
+    return true;
+  collectEmergency();
+  return vm.bytesAllocated + bytes <= gcConfig.heapLimit;
+}
+
+// Where "object" is now, if a compaction has moved it
+static Obj *forwarded(Obj *object) {
+  if (object != NULL && (objHeader(object) & OBJ_FORWARDED) != 0)
+    return objNext(object);
+  return object;
+}
+
+static void forwardValue(Value *value) {
+  if (IS_OBJ(*value))
+    *value = OBJ_VAL(forwarded(AS_OBJ(*value)));
+}
+
+// Keys and values are updated in place: hashes are kept in the strings, so
+// nothing moves within the table
+static void forwardTable(Table *table) {
+  for (int i = 0; i < table->capacity; i++) {
+    Entry *entry = &table->entries[i];
+    entry->key = (ObjString *)forwarded((Obj *)entry->key);
+    forwardValue(&entry->value);
+  }
+}
+
+// Copy "object" off its evacuated page and leave its new address in the old
+// copy's header
+static void moveObject(Obj *object) {
+  size_t size = structSize(object);
+  Obj *copy = (Obj *)heapAllocate(size);
+  memcpy(copy, object, size);
+
+  // A closed upvalue points at its own "closed" field
+  if (objType(object) == OBJ_UPVALUE &&
+      ((ObjUpvalue *)object)->location == &((ObjUpvalue *)object)->closed)
+    ((ObjUpvalue *)copy)->location = &((ObjUpvalue *)copy)->closed;
+  // Old objects of the generational collector stay old
+  if (heapIsMarked(object))
+    heapMark(copy);
+
+  setObjHeader(object, (objHeader(object) & ~OBJ_NEXT_MASK) | OBJ_FORWARDED |
+                           (uint64_t)(uintptr_t)copy);
+}
+
+// Point the references held by "object" (including the next object) at where
+// the objects they refer to are now
+static void forwardReferences(Obj *object) {
+  switch (objType(object)) {
+  case OBJ_CLOSURE: {
+    ObjClosure *closure = (ObjClosure *)object;
+    closure->function = (ObjFunction *)forwarded((Obj *)closure->function);
+    for (int i = 0; i < closure->upvalueCount; i++)
+      closure->upvalues[i] =
+          (ObjUpvalue *)forwarded((Obj *)closure->upvalues[i]);
+    break;
+  }
+  case OBJ_FUNCTION: {
+    ObjFunction *function = (ObjFunction *)object;
+    function->name = (ObjString *)forwarded((Obj *)function->name);
+    for (int i = 0; i < function->chunk.constants.count; i++)
+      forwardValue(&function->chunk.constants.values[i]);
+    break;
+  }
+  case OBJ_UPVALUE: {
+    ObjUpvalue *upvalue = (ObjUpvalue *)object;
+    forwardValue(&upvalue->closed);
+    upvalue->next = (ObjUpvalue *)forwarded((Obj *)upvalue->next);
+    break;
+  }
+  case OBJ_NATIVE:
+  case OBJ_STRING:
+    break;
+  }
+  setObjNext(object, forwarded(objNext(object)));
+}
+
+void compactHeap() {
+  vm.compactRequested = false;
+  // Marking and sweeping threads hold pointers to objects of their own
+  if (vm.gcMarking || sweeping)
+    return;
+
+  uint64_t start = beginPause("compact");
+  size_t pages = heapBeginEvacuation();
+  size_t moved = 0;
+  if (pages > 0) {
+    for (Obj *object = vm.objects; object != NULL;) {
+      Obj *next = objNext(object);
+      if (heapIsEvacuating(object)) {
+        moveObject(object);
+        moved++;
+      }
+      object = next;
+    }
+
+    // Every reference to a moved object is either in another object or a
+    // root. The old copies stay readable until "heapEndEvacuation()"
+    vm.objects = forwarded(vm.objects);
+    for (Obj *object = vm.objects; object != NULL; object = objNext(object))
+      forwardReferences(object);
+
+    for (Value *slot = vm.stack; slot < vm.stackTop; slot++)
+      forwardValue(slot);
+    for (int i = 0; i < vm.frameCount; i++)
+      vm.frames[i].closure =
+          (ObjClosure *)forwarded((Obj *)vm.frames[i].closure);
+    vm.openUpvalues = (ObjUpvalue *)forwarded((Obj *)vm.openUpvalues);
+    forwardTable(&vm.globals);
+    forwardTable(&vm.strings);
+    vm.firstOld = forwarded(vm.firstOld);
+    for (int i = 0; i < vm.rememberedCount; i++)
+      vm.remembered[i] = forwarded(vm.remembered[i]);
+
+    heapEndEvacuation();
+  }
+
+#ifdef DEBUG_LOG_GC
+  if (debugFlags.logGC)
+    printf("   moved %zu objects off %zu pages\n", moved, pages);
+#endif
+  if (pages > 0)
+    recordCompaction(moved, pages);
+  endPause("compact", start);
 }
 
 void freeObjects() {
+  // The marking thread must not look at objects that are being freed
+  if (markerRunning) {
+    pthread_join(markerThread, NULL);
+    markerRunning = false;
+  }
+  stopWorkers();
+  finishSweeping();
+  gcThreadsMarking = false;
+  free(markerGray.objects);
+  markerGray.objects = NULL;
+  markerGray.capacity = 0;
+  markerGray.count = 0;
+
   Obj *object = vm.objects;
   // Walk through linked list and free objects
   while (object != NULL) {
-    Obj *next = object->next;
+    Obj *next = objNext(object);
     freeObject(object);
     object = next;
   }
+  freeHeap();
+  vm.objects = NULL;
+  vm.firstOld = NULL;
+  vm.gcMarking = false;
+  vm.grayCount = 0;
 
   free(vm.grayStack);
+  vm.bytesAllocated -= sizeof(Obj *) * vm.grayCapacity;
+  vm.grayStack = NULL;
+  vm.grayCapacity = 0;
+
+  free(vm.remembered);
+  vm.bytesAllocated -= sizeof(Obj *) * vm.rememberedCapacity;
+  vm.remembered = NULL;
+  vm.rememberedCount = 0;
+  vm.rememberedCapacity = 0;
 }
@@ -2,6 +2,7 @@
 #define clox_memory_h
 
 #include "common.h"
+#include "heap.h"
 #include "object.h"
 
 // Alloc space for array of type "type" and length "count"
@@ -35,15 +36,185 @@
  */
 void *reallocate(void *pointer, size_t oldSize, size_t newSize);
 
+// Free an object of type "type" allocated by "allocateObjectMemory()"
+#define FREE_OBJ(type, pointer) freeObjectMemory(pointer, sizeof(type))
+
+// Allocate "size" bytes for a new object from the object heap (see "heap.h"),
+// counting them like "reallocate()" does
+void *allocateObjectMemory(size_t size);
+
+// Free the "size" bytes of an object allocated by "allocateObjectMemory()"
+void freeObjectMemory(void *object, size_t size);
+
+// Collection strategies of the garbage collector
+typedef enum {
+  // Every collection marks and sweeps the whole heap
+  GC_STOP_THE_WORLD,
+  // Most collections only mark and sweep the objects allocated since the
+  // previous one (the nursery). Objects that survive a collection become old
+  // and are only freed by full collections, which happen when the heap
+  // reaches the threshold computed from "growthFactor"
+  GC_GENERATIONAL,
+  // Marking is spread over short slices that "run()" interleaves with the
+  // program, each at most "sliceNanos" long and one for every "stepSize"
+  // bytes allocated. Write barriers and allocating new objects marked keep
+  // the objects that the program moves around from being missed
+  GC_INCREMENTAL,
+  // Marking runs on a background thread from a snapshot of the roots taken at
+  // a safepoint, while the program keeps running. Stores that overwrite a
+  // reference the thread may not have seen yet mark the old value (snapshot
+  // at the beginning), so that only the snapshot and the final sweep pause
+  // the program
+  GC_CONCURRENT,
+} GCMode;
+
+// When the garbage collector frees the objects it did not reach
+typedef enum {
+  // All of them before the program continues
+  SWEEP_EAGER,
+  // A few at a time, whenever the program has allocated another "stepSize"
+  // bytes, so that the pause only covers marking
+  SWEEP_LAZY,
+  // On a thread of their own while the program continues
+  SWEEP_BACKGROUND,
+} SweepMode;
+
+/* Heap sizing policy of the garbage collector:
+         - "threshold" is the heap size that triggers the first collection
+         - "growthFactor" decides when the next collection happens: once the
+   heap has grown to this multiple of what survived the last one
+         - "minHeap" and "maxHeap" bound the heap size that triggers the next
+   collection, which keeps the collector from running constantly while the
+   heap is small and the heap from doubling without bound while it is large
+   ("maxHeap" is 0 for no bound)
+         - "mode" is the collection strategy
+         - "nurserySize" is how many bytes can be allocated between two
+   collections of the nursery in generational mode
+         - "stepSize" is how many bytes can be allocated between two slices of
+   marking in incremental mode (or between two checks whether concurrent
+   marking is done), and "sliceNanos" how long a slice may take
+         - "markThreads" is how many threads mark the heap together (1 marks
+   on the collecting thread alone)
+         - "sweepMode" is when unreachable objects are freed (always eagerly
+   in generational mode)
+         - "heapLimit" is the most the heap may grow to (0 for no limit).
+   Past it the collector runs at once, and if that doesn't free enough the
+   program is stopped with an out of memory runtime error
+         - "compactThreshold" is the fraction of the object pages that a
+   collection has to leave reclaimable by packing their objects together
+   (see "heapFragmentation()") for the heap to be compacted (0 never
+   compacts)
+ */
+typedef struct {
+  GCMode mode;
+  size_t nurserySize;
+  size_t stepSize;
+  uint64_t sliceNanos;
+  int markThreads;
+  SweepMode sweepMode;
+  size_t threshold;
+  double growthFactor;
+  size_t minHeap;
+  size_t maxHeap;
+  double compactThreshold;
+  size_t heapLimit;
+} GCConfig;
+
+extern GCConfig gcConfig;
+
+// Set the "gcConfig" field for the option "name" ("gc", "gc-nursery",
+// "gc-step", "gc-slice", "gc-mark-threads", "gc-sweep", "gc-compact",
+// "gc-threshold", "gc-growth", "gc-min-heap", "gc-max-heap" or "heap-limit")
+// from "value".
+// Sizes are in bytes and may end in k, m or g, "gc-slice" is in microseconds
+// and "gc-compact" is a fraction below 1. Returns false if either the name or
+// the value is invalid
+bool setGCOption(const char *name, const char *value);
+
+// Whether threads other than the main one are marking objects right now
+extern bool gcThreadsMarking;
+
 // Check if an object is no longer in use
 void markObject(Obj *object);
 
 // Mark value if it is heap allocated and out of use
 void markValue(Value value);
 
-// Collects unused memory
+// Mark "object" and trace its references again even if it is marked already,
+// for objects that may have changed since they were last traced
+void rescanObject(Obj *object);
+
+// Slow path of "writeBarrier()": remember "object" in generational mode, or
+// mark "value" while incremental marking is in progress
+void writeBarrierSlow(Obj *object, Value value);
+
+// Write barrier, called when "value" is stored in "object". Only old objects
+// (in generational mode) and objects already reached by the marking in
+// progress (in incremental mode) are marked outside a collection, so this only
+// leaves the fast path when such an object is made to refer to one that isn't
+static inline void writeBarrier(Obj *object, Value value) {
+  if (heapIsMarked(object) && IS_OBJ(value) && !heapIsMarked(AS_OBJ(value)))
+    writeBarrierSlow(object, value);
+}
+
+// Store "value" in the closed upvalue "upvalue" while a marking thread may be
+// reading it
+void writeUpvalueLocked(ObjUpvalue *upvalue, Value value);
+
+// Store "value" in the closed upvalue "upvalue" with the barrier the current
+// collection mode needs
+static inline void writeClosedUpvalue(ObjUpvalue *upvalue, Value value) {
+  if (gcThreadsMarking) {
+    writeUpvalueLocked(upvalue, value);
+    return;
+  }
+  writeBarrier((Obj *)upvalue, value);
+  upvalue->closed = value;
+}
+
+// Tell the collector that "object" has changed in a way the write barriers
+// did not see, so that it is looked at again
+void objectChanged(Obj *object);
+
+// Run one slice of incremental marking, which finishes the collection once
+// there is nothing left to mark, or start or finish concurrent marking.
+// "run()" calls this at a safepoint after a collection step has asked for it
+// through "vm.gcSliceRequested"
+void collectGarbageSlice();
+
+// Move the objects off the sparsest pages into the free cells of the others
+// and update every reference to them, so that those pages can be handed back.
+// "run()" calls this at a safepoint after a collection has asked for it
+// through "vm.compactRequested", once no native function holds pointers to
+// objects. Does nothing while a collection is in progress
+void compactHeap();
+
+// Whether "bytes" more can be allocated without going past
+// "gcConfig.heapLimit", after collecting all the garbage there is if need be.
+// Lets a single large allocation fail before it is made
+bool reserveHeap(size_t bytes);
+
+// Number of bytes "object" uses, including the arrays it owns
+size_t objectSize(Obj *object);
+
+// Finish the lazy or background sweep in progress, if any, so that
+// "vm.objects" holds every object again
+void finishSweeping();
+
+// Set "toSweep" to the objects that the sweep in progress has yet to look at
+// and "survivors" to those it has kept so far, which are not on "vm.objects"
+// until it is finished (both NULL if there is none). Waits for the sweeping
+// thread, if any, so that neither list changes while it is walked
+void sweepInProgress(Obj **toSweep, Obj **survivors);
+
+// Collects unused memory (in incremental and concurrent mode: starts or
+// advances a collection)
 void collectGarbage();
 
+// Collect everything that is unreachable, whatever the collection mode, and
+// sweep it before returning
+void collectAllGarbage();
+
 // Free all of the object references in the linked list
 void freeObjects();
 
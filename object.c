@@ -1,32 +1,53 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "allocsites.h"
 #include "memory.h"
 #include "object.h"
+#include "probes.h"
 #include "table.h"
 #include "value.h"
 #include "vm.h"
 
+#ifdef DEBUG_LOG_GC
+#include "debug.h"
+#endif
+
 // Allocate space for any object type
 #define ALLOCATE_OBJ(type, objectType)                                         \
   (type *)allocateObject(sizeof(type), objectType)
 
-// "Generic" function which allows you to allocate space for any object type but
-// as a "Obj *" to avoid redundant casting from "void *"
-static Obj *allocateObject(size_t size, ObjType type) {
-  Obj *object = (Obj *)reallocate(NULL, 0, size);
-  object->type = type;
-  object->isMarked = false;
-  object->next = vm.objects;
+// Put "object", whose "size" bytes have just been allocated, on the list of
+// objects
+static Obj *initObject(Obj *object, size_t size, ObjType type) {
+  object->header = (uint64_t)(uintptr_t)vm.objects |
+                   (uint64_t)type << OBJ_TYPE_SHIFT;
   vm.objects = object;
+  // Objects created while incremental marking is in progress are kept alive
+  // until the next collection. Otherwise their mark bit is clear already
+  if (vm.gcMarking)
+    heapMark(object);
+
+  PROBE3(object__alloc, object, size, (int)type);
+#ifdef PROFILE_ALLOCSITES
+  if (allocSitesEnabled)
+    countAllocationSite(type, size);
+#endif
 
 #ifdef DEBUG_LOG_GC
-  printf("%p allocate %zu for %d\n", (void *)object, size, type);
+  if (debugFlags.logGC)
+    printf("%p allocate %zu for %d\n", (void *)object, size, type);
 #endif
 
   return object;
 }
 
+// "Generic" function which allows you to allocate space for any object type but
+// as a "Obj *" to avoid redundant casting from "void *"
+static Obj *allocateObject(size_t size, ObjType type) {
+  return initObject((Obj *)allocateObjectMemory(size), size, type);
+}
+
 ObjClosure *newClosure(ObjFunction *function) {
   ObjUpvalue **upvalues = ALLOCATE(ObjUpvalue *, function->upvalueCount);
   for (int i = 0; i < function->upvalueCount; i++)
@@ -46,24 +67,42 @@ ObjFunction *newFunction() {
   function->arity = 0;
   function->upvalueCount = 0;
   function->name = NULL;
+#ifdef PROFILE_CALLS
+  function->profileId = -1;
+#endif
   initChunk(&function->chunk);
   return function;
 }
 
-ObjNative *newNative(NativeFn function) {
+ObjNative *newNative(NativeFn function, const char *name) {
   ObjNative *native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
   native->function = function;
+  native->name = name;
+#ifdef PROFILE_CALLS
+  native->profileId = -1;
+#endif
   return native;
 }
 
-// Construct ObjString from freshly copied C string
-static ObjString *allocateString(char *chars, int length, uint32_t hash) {
-  ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+ObjString *allocateString(int length) {
+  ObjString *string =
+      (ObjString *)allocateObjectMemory(sizeof(ObjString) + length + 1);
   string->length = length;
-  string->chars = chars;
+  string->chars[length] = '\0';
+  return string;
+}
+
+// Put "string", filled in, on the list of objects and into "vm.strings"
+static ObjString *internString(ObjString *string, uint32_t hash) {
   string->hash = hash;
+  initObject((Obj *)string, sizeof(ObjString) + string->length + 1,
+             OBJ_STRING);
 
+  // Growing "vm.strings" can trigger a collection, which would free the new
+  // string since nothing refers to it yet
+  push(OBJ_VAL(string));
   tableSet(&vm.strings, string, NIL_VAL);
+  pop();
 
   return string;
 }
@@ -80,36 +119,52 @@ static uint32_t hashString(const char *key, int length) {
   return hash;
 }
 
-ObjString *takeString(char *chars, int length) {
-  uint32_t hash = hashString(chars, length);
+// Return the interned string "interned" to the program. While marking is in
+// progress it may be white and only referred to by "vm.strings", which does
+// not keep it alive, so mark it before it ends up where the collector will
+// not look again
+static ObjString *reuseInterned(ObjString *interned) {
+  if (vm.gcMarking)
+    markObject((Obj *)interned);
+  return interned;
+}
+
+ObjString *takeString(ObjString *string) {
+  int length = string->length;
+  uint32_t hash = hashString(string->chars, length);
 
   // Interned string from "vm.strings" table
-  ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
+  ObjString *interned =
+      tableFindString(&vm.strings, string->chars, length, hash);
   // Check if the string does exist in the table if so,
-  // free the original and return a pointer to the interned one within
+  // free the new one and return a pointer to the interned one within
   // "vm.strings"
   if (interned != NULL) {
-    FREE_ARRAY(char, chars, length + 1);
-    return interned;
+    PROBE3(string__intern, interned->chars, length, 1);
+    freeObjectMemory(string, sizeof(ObjString) + length + 1);
+    return reuseInterned(interned);
   }
 
-  return allocateString(chars, length, hash);
+  PROBE3(string__intern, string->chars, length, 0);
+  return internString(string, hash);
 }
 
 ObjString *copyString(const char *chars, int length) {
   uint32_t hash = hashString(chars, length);
   ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
 
-  if (interned != NULL)
-    return interned;
+  if (interned != NULL) {
+    PROBE3(string__intern, interned->chars, length, 1);
+    return reuseInterned(interned);
+  }
 
-  char *heapChars = ALLOCATE(char, length + 1);
-  memcpy(heapChars, chars, length);
-  // Manually null terminate because the lexeme points to a section of the
-  // original source string and therefore won't have a null terminator
-  heapChars[length] = '\0';
+  // "allocateString()" adds the null terminator, which the lexeme lacks
+  // because it points to a section of the original source string
+  ObjString *string = allocateString(length);
+  memcpy(string->chars, chars, length);
 
-  return allocateString(heapChars, length, hash);
+  PROBE3(string__intern, string->chars, length, 0);
+  return internString(string, hash);
 }
 
 ObjUpvalue *newUpvalue(Value *slot) {
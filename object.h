@@ -5,7 +5,7 @@
 #include "common.h"
 #include "value.h"
 
-#define OBJ_TYPE(value) (AS_OBJ(value)->type)
+#define OBJ_TYPE(value) objType(AS_OBJ(value))
 
 // Type check macros
 
@@ -39,18 +39,71 @@ typedef enum {
    any other object type)
 */
 
+/* Header shared by every object, packed into a single word:
+         - the low 48 bits are "next", which links every object into
+   "vm.objects" (user space pointers fit in 48 bits on every 64-bit platform
+   clox runs on)
+         - the next 8 bits are the object's "ObjType"
+         - the top 8 bits are flags, "OBJ_REMEMBERED" being set while the
+   object is in the generational collector's remembered set and
+   "OBJ_FORWARDED" once a compaction has moved the object, whose header then
+   holds its new address in place of the next object
+   Whether an object is marked is kept in the mark bitmap of its page instead
+   (see "heap.h"). In generational mode the mark stays set after a collection
+   and makes the object old (see "gcConfig")
+ */
 struct Obj {
-  ObjType type;
-  bool isMarked;
-  struct Obj *next;
+  uint64_t header;
 };
 
+#define OBJ_NEXT_MASK (((uint64_t)1 << 48) - 1)
+#define OBJ_TYPE_SHIFT 48
+#define OBJ_FLAGS_SHIFT 56
+#define OBJ_REMEMBERED ((uint64_t)1 << OBJ_FLAGS_SHIFT)
+#define OBJ_FORWARDED ((uint64_t)1 << (OBJ_FLAGS_SHIFT + 1))
+
+// The header is read atomically since the sweeping thread may be relinking an
+// object while the program looks at its type
+static inline uint64_t objHeader(Obj *object) {
+  return __atomic_load_n(&object->header, __ATOMIC_RELAXED);
+}
+
+static inline void setObjHeader(Obj *object, uint64_t header) {
+  __atomic_store_n(&object->header, header, __ATOMIC_RELAXED);
+}
+
+static inline ObjType objType(Obj *object) {
+  return (ObjType)((objHeader(object) >> OBJ_TYPE_SHIFT) & 0xff);
+}
+
+static inline Obj *objNext(Obj *object) {
+  return (Obj *)(uintptr_t)(objHeader(object) & OBJ_NEXT_MASK);
+}
+
+static inline void setObjNext(Obj *object, Obj *next) {
+  setObjHeader(object, (objHeader(object) & ~OBJ_NEXT_MASK) |
+                           (uint64_t)(uintptr_t)next);
+}
+
+static inline bool isRemembered(Obj *object) {
+  return (objHeader(object) & OBJ_REMEMBERED) != 0;
+}
+
+static inline void setRemembered(Obj *object, bool remembered) {
+  uint64_t header = objHeader(object) & ~OBJ_REMEMBERED;
+  setObjHeader(object, remembered ? header | OBJ_REMEMBERED : header);
+}
+
 typedef struct {
   Obj obj;
   int arity;
   int upvalueCount;
   Chunk chunk;
   ObjString *name;
+#ifdef PROFILE_CALLS
+  // Index of the function in the call profile, or -1 until it is first called
+  int profileId;
+#endif
 } ObjFunction;
 
 // Pointer to native/built-in function
@@ -59,13 +112,19 @@ typedef Value (*NativeFn)(int argCount, Value *args);
 typedef struct {
   Obj obj;
   NativeFn function;
+  // Name the native was defined with (a string literal, not a Lox string)
+  const char *name;
+#ifdef PROFILE_CALLS
+  int profileId;
+#endif
 } ObjNative;
 
+// The characters follow the header in the same allocation, null terminated
 struct ObjString {
   Obj obj;
   int length;
-  char *chars;
   uint32_t hash;
+  char chars[];
 };
 
 // Captures value from stack as upvalue for use in closures
@@ -96,10 +155,17 @@ ObjClosure *newClosure(ObjFunction *function);
 ObjFunction *newFunction();
 
 // Allocate and initialise native function
-ObjNative *newNative(NativeFn function);
+ObjNative *newNative(NativeFn function, const char *name);
+
+// Allocate a string with room for "length" characters (and the null
+// terminator) for the caller to fill in and then hand to "takeString()". Until
+// then it is not on the list of objects, so the collector neither frees nor
+// moves it
+ObjString *allocateString(int length);
 
-// Take ownership of string (instead of copying) and wrap in string object
-ObjString *takeString(char *chars, int length);
+// Take ownership of "string" from "allocateString()" and intern it, or free it
+// and return the interned string with the same characters if there is one
+ObjString *takeString(ObjString *string);
 
 // Copy string over from source code string
 // (to prevent trying to free parts of the original string)
@@ -113,7 +179,7 @@ ObjUpvalue *newUpvalue(Value *slot);
 void printObject(Value value);
 
 static inline bool isObjType(Value value, ObjType type) {
-  return IS_OBJ(value) && AS_OBJ(value)->type == type;
+  return IS_OBJ(value) && objType(AS_OBJ(value)) == type;
 }
 
 #endif
@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "chunk.h"
+#include "debug.h"
+#include "opstats.h"
+#include "timer.h"
+
+// Opcodes are numbered from 0 and OP_RETURN is the last one
+#define OPCODE_COUNT (OP_RETURN + 1)
+// How many of the most frequent pairs and triples to report
+#define TOP_SEQUENCES 25
+
+// Groups of related opcodes that execution time is reported for
+typedef enum {
+  CLASS_CONSTANT,
+  CLASS_STACK,
+  CLASS_LOCAL,
+  CLASS_GLOBAL,
+  CLASS_UPVALUE,
+  CLASS_ARITHMETIC,
+  CLASS_COMPARISON,
+  CLASS_JUMP,
+  CLASS_CALL,
+  CLASS_PRINT,
+  CLASS_COUNT,
+} OpClass;
+
+static const char *classNames[] = {
+    [CLASS_CONSTANT] = "constants",    [CLASS_STACK] = "stack",
+    [CLASS_LOCAL] = "locals",          [CLASS_GLOBAL] = "globals",
+    [CLASS_UPVALUE] = "upvalues",      [CLASS_ARITHMETIC] = "arithmetic",
+    [CLASS_COMPARISON] = "comparison", [CLASS_JUMP] = "jumps",
+    [CLASS_CALL] = "calls",            [CLASS_PRINT] = "print",
+};
+
+static const OpClass opcodeClasses[OPCODE_COUNT] = {
+    [OP_CONSTANT] = CLASS_CONSTANT,     [OP_NIL] = CLASS_CONSTANT,
+    [OP_TRUE] = CLASS_CONSTANT,         [OP_FALSE] = CLASS_CONSTANT,
+    [OP_POP] = CLASS_STACK,             [OP_GET_LOCAL] = CLASS_LOCAL,
+    [OP_SET_LOCAL] = CLASS_LOCAL,       [OP_GET_GLOBAL] = CLASS_GLOBAL,
+    [OP_DEFINE_GLOBAL] = CLASS_GLOBAL,  [OP_SET_GLOBAL] = CLASS_GLOBAL,
+    [OP_GET_UPVALUE] = CLASS_UPVALUE,   [OP_SET_UPVALUE] = CLASS_UPVALUE,
+    [OP_EQUAL] = CLASS_COMPARISON,      [OP_GREATER] = CLASS_COMPARISON,
+    [OP_LESS] = CLASS_COMPARISON,       [OP_ADD] = CLASS_ARITHMETIC,
+    [OP_SUBTRACT] = CLASS_ARITHMETIC,   [OP_MULTIPLY] = CLASS_ARITHMETIC,
+    [OP_DIVIDE] = CLASS_ARITHMETIC,     [OP_NOT] = CLASS_ARITHMETIC,
+    [OP_NEGATE] = CLASS_ARITHMETIC,     [OP_PRINT] = CLASS_PRINT,
+    [OP_JUMP] = CLASS_JUMP,             [OP_JUMP_IF_FALSE] = CLASS_JUMP,
+    [OP_LOOP] = CLASS_JUMP,             [OP_CALL] = CLASS_CALL,
+    [OP_CLOSURE] = CLASS_CALL,          [OP_CLOSE_UPVALUE] = CLASS_UPVALUE,
+    [OP_RETURN] = CLASS_CALL,
+};
+
+bool opstatsEnabled = false;
+
+static const char *reportPath = NULL;
+
+static uint64_t counts[OPCODE_COUNT];
+static uint64_t pairs[OPCODE_COUNT][OPCODE_COUNT];
+static uint64_t triples[OPCODE_COUNT][OPCODE_COUNT][OPCODE_COUNT];
+static uint64_t classNanos[CLASS_COUNT];
+static uint64_t total = 0;
+
+// The two previously executed instructions, or -1 at the start of a "run()"
+static int previous = -1;
+static int beforePrevious = -1;
+static uint64_t previousStart = 0;
+
+void resumeOpstats() {
+  previous = -1;
+  beforePrevious = -1;
+}
+
+void recordInstruction(uint8_t instruction) {
+  uint64_t now = monotonicNanos();
+  if (instruction >= OPCODE_COUNT)
+    return;
+
+  counts[instruction]++;
+  total++;
+  if (previous >= 0) {
+    classNanos[opcodeClasses[previous]] += now - previousStart;
+    pairs[previous][instruction]++;
+    if (beforePrevious >= 0)
+      triples[beforePrevious][previous][instruction]++;
+  }
+
+  beforePrevious = previous;
+  previous = instruction;
+  previousStart = now;
+}
+
+/* An opcode, pair or triple and how often it was executed
+         - "index" encodes the opcodes as digits in base OPCODE_COUNT
+         - "count" is how many times it was executed
+ */
+typedef struct {
+  int index;
+  uint64_t count;
+} Sequence;
+
+static int compareSequences(const void *a, const void *b) {
+  uint64_t countA = ((const Sequence *)a)->count;
+  uint64_t countB = ((const Sequence *)b)->count;
+  return countA < countB ? 1 : countA > countB ? -1 : 0;
+}
+
+static double percent(uint64_t part, uint64_t whole) {
+  return whole == 0 ? 0.0 : 100.0 * (double)part / (double)whole;
+}
+
+// Print the "limit" most frequent of the "count" sequences of "length" opcodes
+// stored in "counters"
+static void reportSequences(FILE *out, const char *title,
+                            const uint64_t *counters, int count, int length,
+                            int limit) {
+  Sequence *sequences = (Sequence *)malloc(sizeof(Sequence) * count);
+  int used = 0;
+  uint64_t sum = 0;
+  for (int i = 0; i < count; i++) {
+    if (counters[i] == 0)
+      continue;
+    sequences[used++] = (Sequence){i, counters[i]};
+    sum += counters[i];
+  }
+  qsort(sequences, used, sizeof(Sequence), compareSequences);
+
+  fprintf(out, "=== %s ===\n", title);
+  for (int i = 0; i < used && i < limit; i++) {
+    // Decode the opcodes from most to least significant digit
+    int divisor = 1;
+    for (int j = 1; j < length; j++)
+      divisor *= OPCODE_COUNT;
+    for (int j = 0; j < length; j++) {
+      int opcode = sequences[i].index / divisor % OPCODE_COUNT;
+      fprintf(out, "%s%-17s", j > 0 ? " " : "", opcodeName(opcode));
+      divisor /= OPCODE_COUNT;
+    }
+    fprintf(out, " %14llu %6.2f%%\n", (unsigned long long)sequences[i].count,
+            percent(sequences[i].count, sum));
+  }
+  fprintf(out, "\n");
+  free(sequences);
+}
+
+static void writeReport() {
+  FILE *out = stderr;
+  if (reportPath != NULL) {
+    out = fopen(reportPath, "w");
+    if (out == NULL) {
+      fprintf(stderr, "Couldn't open opstats report \"%s\"\n", reportPath);
+      return;
+    }
+  }
+
+  fprintf(out, "%llu instructions executed\n\n", (unsigned long long)total);
+  reportSequences(out, "opcodes", counts, OPCODE_COUNT, 1, OPCODE_COUNT);
+  reportSequences(out, "opcode pairs", &pairs[0][0],
+                  OPCODE_COUNT * OPCODE_COUNT, 2, TOP_SEQUENCES);
+  reportSequences(out, "opcode triples", &triples[0][0][0],
+                  OPCODE_COUNT * OPCODE_COUNT * OPCODE_COUNT, 3,
+                  TOP_SEQUENCES);
+
+  uint64_t totalNanos = 0;
+  for (int i = 0; i < CLASS_COUNT; i++)
+    totalNanos += classNanos[i];
+  fprintf(out, "=== time per opcode class ===\n");
+  for (int i = 0; i < CLASS_COUNT; i++)
+    fprintf(out, "%-17s %14.3f ms %6.2f%%\n", classNames[i],
+            classNanos[i] / 1e6, percent(classNanos[i], totalNanos));
+
+  if (out != stderr)
+    fclose(out);
+}
+
+void enableOpstats(const char *path) {
+  if (!opstatsEnabled)
+    atexit(writeReport);
+  opstatsEnabled = true;
+  reportPath = path;
+}
@@ -0,0 +1,20 @@
+#ifndef clox_opstats_h
+#define clox_opstats_h
+
+#include "common.h"
+
+// Whether "run()" should count the instructions it executes
+extern bool opstatsEnabled;
+
+// Start counting instructions and write the report to "path" (or to stderr if
+// "path" is NULL) when the interpreter exits
+void enableOpstats(const char *path);
+
+// Mark the start of "run()" so time spent outside of it is not counted
+void resumeOpstats();
+
+// Count "instruction" (along with the instructions executed just before it)
+// and charge the time since the previous instruction to that one's class
+void recordInstruction(uint8_t instruction);
+
+#endif
@@ -0,0 +1,233 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "perfcounters.h"
+
+#ifdef __linux__
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Deepest nesting of phases (e.g. a collection triggered while compiling)
+#define MAX_PHASE_DEPTH 8
+
+/* A hardware event to count
+         - "name" is what it is called in the report
+         - "type" and "config" select the event for perf_event_open
+ */
+typedef struct {
+  const char *name;
+  uint32_t type;
+  uint64_t config;
+} CounterEvent;
+
+#ifdef __linux__
+#define CACHE_MISS(cache)                                                      \
+  ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) |                              \
+   (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const CounterEvent events[] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {"L1d-misses", PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_L1D)},
+    {"LLC-misses", PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_LL)},
+    {"dTLB-misses", PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_DTLB)},
+};
+
+#undef CACHE_MISS
+#else
+static const CounterEvent events[] = {{"cycles", 0, 0}};
+#endif
+
+#define EVENT_COUNT (int)(sizeof(events) / sizeof(events[0]))
+
+static const char *phaseNames[] = {
+    [PERF_COMPILE] = "compile",
+    [PERF_RUN] = "run",
+    [PERF_GC] = "gc",
+};
+
+bool perfCountersEnabled = false;
+
+/* A reading of a counter:
+         - "value" is the raw count
+         - "enabled" and "running" are the nanoseconds the counter has been
+   enabled and actually counting for, which differ when the kernel multiplexes
+   more events than there are hardware counters
+ */
+typedef struct {
+  uint64_t value;
+  uint64_t enabled;
+  uint64_t running;
+} CounterReading;
+
+// File descriptor of each counter, or -1 if it couldn't be opened
+static int counters[EVENT_COUNT];
+// Reading of each counter at the last phase change
+static CounterReading lastReadings[EVENT_COUNT];
+// Counts charged to each phase
+static uint64_t totals[PERF_PHASE_COUNT][EVENT_COUNT];
+
+// The phases that have begun and not ended yet, innermost last. Only the first
+// "MAX_PHASE_DEPTH" are kept, deeper ones are charged to the last of those
+static PerfPhase phases[MAX_PHASE_DEPTH];
+static int phaseDepth = 0;
+
+#ifdef __linux__
+static int openCounter(const CounterEvent *event) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = event->type;
+  attr.config = event->config;
+  // Only count the interpreter itself, which also needs fewer privileges
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  // The kernel multiplexes counters when there are more events than hardware
+  // counters, so ask for the times needed to scale the counts back up
+  attr.read_format =
+      PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+  return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// Read counter "index", or return its last reading if that fails
+static CounterReading readCounter(int index) {
+  uint64_t data[3];
+  if (read(counters[index], data, sizeof(data)) != sizeof(data))
+    return lastReadings[index];
+  return (CounterReading){data[0], data[1], data[2]};
+}
+
+// Estimate of what counter "index" counted between its last reading and
+// "now". Each interval is scaled up by its own share of the time the counter
+// was running: scaling the totals instead gives estimates that can go down
+// when the share changes, and their difference would wrap around
+static uint64_t countSince(int index, CounterReading now) {
+  CounterReading last = lastReadings[index];
+  if (now.value < last.value || now.running <= last.running)
+    return 0;
+  uint64_t counted = now.value - last.value;
+  uint64_t enabled = now.enabled - last.enabled;
+  uint64_t running = now.running - last.running;
+  if (enabled <= running)
+    return counted;
+  return (uint64_t)((double)counted * (double)enabled / (double)running);
+}
+#endif
+
+// Charge everything counted since the last phase change to the current phase
+static void chargeCurrentPhase() {
+#ifdef __linux__
+  int depth = phaseDepth < MAX_PHASE_DEPTH ? phaseDepth : MAX_PHASE_DEPTH;
+  for (int i = 0; i < EVENT_COUNT; i++) {
+    if (counters[i] < 0)
+      continue;
+    CounterReading now = readCounter(i);
+    if (depth > 0)
+      totals[phases[depth - 1]][i] += countSince(i, now);
+    lastReadings[i] = now;
+  }
+#endif
+}
+
+void perfPhaseBegin(PerfPhase phase) {
+  chargeCurrentPhase();
+  if (phaseDepth < MAX_PHASE_DEPTH)
+    phases[phaseDepth] = phase;
+  phaseDepth++;
+}
+
+void perfPhaseEnd() {
+  chargeCurrentPhase();
+  if (phaseDepth > 0)
+    phaseDepth--;
+}
+
+static double ratio(uint64_t part, uint64_t whole) {
+  return whole == 0 ? 0.0 : (double)part / (double)whole;
+}
+
+static void writeReport() {
+  chargeCurrentPhase();
+
+  fprintf(stderr, "\n=== hardware counters ===\n%-16s", "");
+  for (int phase = 0; phase < PERF_PHASE_COUNT; phase++)
+    fprintf(stderr, " %16s", phaseNames[phase]);
+  fprintf(stderr, "\n");
+
+  for (int i = 0; i < EVENT_COUNT; i++) {
+    fprintf(stderr, "%-16s", events[i].name);
+    for (int phase = 0; phase < PERF_PHASE_COUNT; phase++) {
+      if (counters[i] < 0)
+        fprintf(stderr, " %16s", "<not supported>");
+      else
+        fprintf(stderr, " %16llu", (unsigned long long)totals[phase][i]);
+    }
+    fprintf(stderr, "\n");
+  }
+
+  // Cycles, instructions and branch misses are the first three events
+  if (EVENT_COUNT >= 3 && counters[0] >= 0 && counters[1] >= 0) {
+    fprintf(stderr, "%-16s", "IPC");
+    for (int phase = 0; phase < PERF_PHASE_COUNT; phase++)
+      fprintf(stderr, " %16.3f", ratio(totals[phase][1], totals[phase][0]));
+    fprintf(stderr, "\n");
+  }
+  if (EVENT_COUNT >= 3 && counters[1] >= 0 && counters[2] >= 0) {
+    fprintf(stderr, "%-16s", "misses/kinstr");
+    for (int phase = 0; phase < PERF_PHASE_COUNT; phase++)
+      fprintf(stderr, " %16.3f",
+              1000.0 * ratio(totals[phase][2], totals[phase][1]));
+    fprintf(stderr, "\n");
+  }
+
+  for (int i = 0; i < EVENT_COUNT; i++) {
+    if (counters[i] >= 0) {
+#ifdef __linux__
+      close(counters[i]);
+#endif
+      counters[i] = -1;
+    }
+  }
+}
+
+bool enablePerfCounters() {
+  if (perfCountersEnabled)
+    return true;
+
+#ifdef __linux__
+  int opened = 0;
+  int error = 0;
+  for (int i = 0; i < EVENT_COUNT; i++) {
+    counters[i] = openCounter(&events[i]);
+    if (counters[i] >= 0)
+      opened++;
+    else
+      error = errno;
+  }
+
+  if (opened == 0) {
+    fprintf(stderr, "Hardware counters are not available (%s)", strerror(error));
+    if (error == EACCES || error == EPERM)
+      fprintf(stderr, ", check /proc/sys/kernel/perf_event_paranoid");
+    fprintf(stderr, "\n");
+    return false;
+  }
+
+  for (int i = 0; i < EVENT_COUNT; i++)
+    if (counters[i] >= 0)
+      lastReadings[i] = readCounter(i);
+
+  perfCountersEnabled = true;
+  atexit(writeReport);
+  return true;
+#else
+  fprintf(stderr, "Hardware counters are only supported on Linux\n");
+  return false;
+#endif
+}
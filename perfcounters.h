@@ -0,0 +1,28 @@
+#ifndef clox_perfcounters_h
+#define clox_perfcounters_h
+
+#include "common.h"
+
+// Parts of the interpreter that hardware counters are reported for
+typedef enum {
+  PERF_COMPILE,
+  PERF_RUN,
+  PERF_GC,
+  PERF_PHASE_COUNT,
+} PerfPhase;
+
+// Whether hardware counters are being read at phase changes
+extern bool perfCountersEnabled;
+
+// Open the hardware performance counters and report them per phase when clox
+// exits. Returns false (after explaining why) if none of them can be opened,
+// e.g. because the kernel denies access
+bool enablePerfCounters();
+
+// Charge the counts so far to the current phase and switch to "phase" until
+// the matching "perfPhaseEnd()"
+void perfPhaseBegin(PerfPhase phase);
+// Charge the counts so far to the current phase and go back to the previous one
+void perfPhaseEnd();
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef clox_probes_h
+#define clox_probes_h
+
+/* Static tracepoints (USDT) for bpftrace, perf and SystemTap, e.g.
+     bpftrace -e 'usdt:./clox:clox:function__entry { @[str(arg0)] = count(); }'
+
+   With <sys/sdt.h> available at build time (systemtap-sdt-dev on Debian) each
+   probe is a single nop plus an ELF note describing its arguments, so they are
+   in every build and cost next to nothing until a tracer attaches. Without it
+   (or with -DCLOX_NO_PROBES) they compile to nothing at all.
+
+   Probes:
+     function__entry(const char *name, int line) - a Lox function or native is
+   called; "line" is the line the function starts on (0 for natives)
+     function__return(const char *name) - a Lox function or native returns
+     object__alloc(void *object, size_t size, int type) - an object is allocated
+     gc__begin() - a collection starts
+     gc__end() - a collection finishes
+     string__intern(const char *chars, int length, int hit) - a string is
+   interned, "hit" is 1 when it was already in the table
+     runtime__error(const char *message) - a runtime error is raised
+ */
+
+#if defined(__has_include) && !defined(CLOX_NO_PROBES)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define CLOX_HAVE_PROBES
+#endif
+#endif
+
+#ifdef CLOX_HAVE_PROBES
+#define PROBE0(name) DTRACE_PROBE(clox, name)
+#define PROBE1(name, a) DTRACE_PROBE1(clox, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(clox, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(clox, name, a, b, c)
+#else
+#define PROBE0(name)                                                           \
+  do {                                                                         \
+  } while (false)
+#define PROBE1(name, a)                                                        \
+  do {                                                                         \
+  } while (false)
+#define PROBE2(name, a, b)                                                     \
+  do {                                                                         \
+  } while (false)
+#define PROBE3(name, a, b, c)                                                  \
+  do {                                                                         \
+  } while (false)
+#endif
+
+#endif
@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "object.h"
+#include "profiler.h"
+#include "vm.h"
+
+// Longest folded stack that is recorded, longer ones are truncated
+#define MAX_STACK_TEXT (FRAMES_MAX * 64)
+
+/* Number of samples taken with one particular call stack
+         - "stack" is the folded stack, e.g. "script:9;fib:3;fib:3"
+         - "count" is how many samples had exactly that stack
+ */
+typedef struct {
+  char *stack;
+  uint64_t count;
+} StackSamples;
+
+volatile sig_atomic_t samplesPending = 0;
+
+// Ticks that arrived while no Lox code was running (e.g. while compiling)
+static volatile sig_atomic_t outsideSamples = 0;
+
+static const char *outputPath = NULL;
+
+// Open addressing hash table of every distinct stack seen so far
+static StackSamples *stacks = NULL;
+static int stackCount = 0;
+static int stackCapacity = 0;
+
+static void handleTick(int signal) {
+  (void)signal;
+  // Taking the sample here would not be async-signal-safe, so just ask "run()"
+  // to do it at its next safepoint
+  if (vm.frameCount == 0) {
+    outsideSamples++;
+    return;
+  }
+  samplesPending++;
+  vm.safepointRequested = 1;
+}
+
+// FNV-1a, like "hashString" in "object.c"
+static uint32_t hashStack(const char *stack) {
+  uint32_t hash = 2166136261u;
+  for (; *stack != '\0'; stack++) {
+    hash ^= (uint8_t)*stack;
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+static StackSamples *findStack(StackSamples *entries, int capacity,
+                               const char *stack, uint32_t hash) {
+  uint32_t index = hash % capacity;
+  for (;;) {
+    StackSamples *entry = &entries[index];
+    if (entry->stack == NULL || strcmp(entry->stack, stack) == 0)
+      return entry;
+    index = (index + 1) % capacity;
+  }
+}
+
+// Add "count" samples of "stack"
+static void addSamples(const char *stack, uint64_t count) {
+  // The profiler's own memory is kept out of "reallocate" so that it does not
+  // count towards (or trigger) garbage collection
+  if (stackCount + 1 > stackCapacity * 3 / 4) {
+    int capacity = stackCapacity < 64 ? 64 : stackCapacity * 2;
+    StackSamples *entries =
+        (StackSamples *)calloc(capacity, sizeof(StackSamples));
+    if (entries == NULL)
+      return;
+    for (int i = 0; i < stackCapacity; i++) {
+      if (stacks[i].stack == NULL)
+        continue;
+      *findStack(entries, capacity, stacks[i].stack,
+                 hashStack(stacks[i].stack)) = stacks[i];
+    }
+    free(stacks);
+    stacks = entries;
+    stackCapacity = capacity;
+  }
+
+  StackSamples *entry =
+      findStack(stacks, stackCapacity, stack, hashStack(stack));
+  if (entry->stack == NULL) {
+    entry->stack = strdup(stack);
+    if (entry->stack == NULL)
+      return;
+    stackCount++;
+  }
+  entry->count += count;
+}
+
+void recordSample() {
+  // Exchange so that ticks arriving while sampling are kept for the next one
+  sig_atomic_t count = __atomic_exchange_n(&samplesPending, 0,
+                                           __ATOMIC_SEQ_CST);
+  if (count <= 0)
+    return;
+
+  char stack[MAX_STACK_TEXT];
+  int length = 0;
+  for (int i = 0; i < vm.frameCount && length < MAX_STACK_TEXT; i++) {
+    CallFrame *frame = &vm.frames[i];
+    ObjFunction *function = frame->closure->function;
+    // The ip has already moved past the instruction being executed
+    int instruction = (int)(frame->ip - function->chunk.code) - 1;
+    int line = function->chunk.lines[instruction < 0 ? 0 : instruction];
+    length += snprintf(stack + length, MAX_STACK_TEXT - length, "%s%s:%d",
+                       i > 0 ? ";" : "",
+                       function->name != NULL ? function->name->chars
+                                              : "script",
+                       line);
+  }
+
+  addSamples(stack, (uint64_t)count);
+}
+
+static void writeSamples() {
+  // Stop the timer before writing so no more ticks arrive
+  struct itimerval timer = {{0, 0}, {0, 0}};
+  setitimer(ITIMER_PROF, &timer, NULL);
+
+  FILE *out = fopen(outputPath, "w");
+  if (out == NULL) {
+    fprintf(stderr, "Couldn't open profile output \"%s\"\n", outputPath);
+    return;
+  }
+
+  for (int i = 0; i < stackCapacity; i++) {
+    if (stacks[i].stack != NULL)
+      fprintf(out, "%s %llu\n", stacks[i].stack,
+              (unsigned long long)stacks[i].count);
+  }
+  if (outsideSamples > 0)
+    fprintf(out, "[outside run] %d\n", (int)outsideSamples);
+
+  fclose(out);
+}
+
+bool startSampling(const char *path, int frequency) {
+  if (frequency <= 0 || frequency > 1000000)
+    return false;
+
+  outputPath = path;
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = handleTick;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  if (sigaction(SIGPROF, &action, NULL) != 0)
+    return false;
+
+  long interval = 1000000L / frequency;
+  struct itimerval timer = {{0, interval}, {0, interval}};
+  if (setitimer(ITIMER_PROF, &timer, NULL) != 0)
+    return false;
+
+  atexit(writeSamples);
+  return true;
+}
@@ -0,0 +1,20 @@
+#ifndef clox_profiler_h
+#define clox_profiler_h
+
+#include <signal.h>
+
+#include "common.h"
+
+// Number of profiling timer ticks that have not been recorded yet, incremented
+// by the SIGPROF handler
+extern volatile sig_atomic_t samplesPending;
+
+// Start sampling the Lox call stack "frequency" times per second of CPU time
+// and write the samples to "path" in folded stack format when clox exits
+bool startSampling(const char *path, int frequency);
+
+// Record the current Lox call stack once for every pending sample (called from
+// a safepoint in "run()")
+void recordSample();
+
+#endif
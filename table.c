@@ -19,9 +19,11 @@ void freeTable(Table *table) {
   initTable(table);
 }
 
-// Figure out where "key" belongs in "entries" (reuses tombstone slots)
+// Figure out where "key" belongs in "entries" (reuses tombstone slots). The
+// capacity is always a power of 2 (see "GROW_CAPACITY"), so the hash is
+// wrapped with a mask rather than a division
 static Entry *findEntry(Entry *entries, int capacity, ObjString *key) {
-  uint32_t index = key->hash % capacity;
+  uint32_t index = key->hash & (capacity - 1);
   Entry *tombstone = NULL;
 
   // Loop for linear probing
@@ -38,7 +40,7 @@ static Entry *findEntry(Entry *entries, int capacity, ObjString *key) {
     } else if (entry->key == key)
       return entry;
 
-    index = (index + 1) % capacity;
+    index = (index + 1) & (capacity - 1);
   }
 }
 
@@ -78,6 +80,7 @@ static void adjustCapacity(Table *table, int capacity) {
     table->count++;
   }
 
+  FREE_ARRAY(Entry, table->entries, table->capacity);
   table->entries = entries;
   table->capacity = capacity;
 }
@@ -132,7 +135,7 @@ ObjString *tableFindString(Table *table, const char *chars, int length,
   if (table->count == 0)
     return NULL;
 
-  uint32_t index = hash % table->capacity;
+  uint32_t index = hash & (table->capacity - 1);
 
   for (;;) {
     Entry *entry = &table->entries[index];
@@ -146,14 +149,14 @@ ObjString *tableFindString(Table *table, const char *chars, int length,
       // Found it 😎
       return entry->key;
 
-    index = (index + 1) % table->capacity;
+    index = (index + 1) & (table->capacity - 1);
   }
 }
 
 void tableRemoveWhite(Table *table) {
   for (int i = 0; i < table->capacity; i++) {
     Entry *entry = &table->entries[i];
-    if (entry->key != NULL && !entry->key->obj.isMarked)
+    if (entry->key != NULL && !heapIsMarked(entry->key))
       tableDelete(table, entry->key);
   }
 }
@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "timeline.h"
+#include "timer.h"
+
+bool timelineEnabled = false;
+
+static FILE *out = NULL;
+static uint64_t startNanos = 0;
+static bool firstEvent = true;
+static int pid = 0;
+
+// Write "text" as the contents of a JSON string
+static void writeEscaped(const char *text) {
+  for (; *text != '\0'; text++) {
+    if (*text == '"' || *text == '\\')
+      fprintf(out, "\\%c", *text);
+    else if ((unsigned char)*text < 0x20)
+      fprintf(out, "\\u%04x", *text);
+    else
+      fputc(*text, out);
+  }
+}
+
+static void writeEvent(char phase, const char *category, const char *name,
+                       const char *args) {
+  // Timestamps are in microseconds since the timeline was started
+  double micros = (monotonicNanos() - startNanos) / 1000.0;
+
+  fprintf(out, "%s\n{\"ph\": \"%c\", \"cat\": \"", firstEvent ? "" : ",",
+          phase);
+  writeEscaped(category);
+  fprintf(out, "\", \"name\": \"");
+  writeEscaped(name);
+  fprintf(out, "\", \"ts\": %.3f, \"pid\": %d, \"tid\": 1", micros, pid);
+  if (args != NULL)
+    fprintf(out, ", \"args\": {%s}", args);
+  fprintf(out, "}");
+  firstEvent = false;
+}
+
+void timelineBegin(const char *category, const char *name) {
+  writeEvent('B', category, name, NULL);
+}
+
+void timelineEnd(const char *category, const char *name, const char *args) {
+  writeEvent('E', category, name, args);
+}
+
+static void closeTimeline() {
+  fprintf(out, "\n]\n");
+  fclose(out);
+  timelineEnabled = false;
+}
+
+bool enableTimeline(const char *path) {
+  if (timelineEnabled)
+    return true;
+
+  out = fopen(path, "w");
+  if (out == NULL)
+    return false;
+
+  fprintf(out, "[");
+  startNanos = monotonicNanos();
+  pid = (int)getpid();
+  timelineEnabled = true;
+  atexit(closeTimeline);
+  return true;
+}
@@ -0,0 +1,19 @@
+#ifndef clox_timeline_h
+#define clox_timeline_h
+
+#include "common.h"
+
+// Whether phase begin/end events are being recorded
+extern bool timelineEnabled;
+
+// Start recording a Chrome trace event timeline (loadable in chrome://tracing
+// and Perfetto) and write it to "path"; returns false if it can't be opened
+bool enableTimeline(const char *path);
+
+// Record the start of a span called "name" in "category"
+void timelineBegin(const char *category, const char *name);
+// Record the end of the innermost span, optionally with "args" (the body of a
+// JSON object, e.g. "\"bytes\": 12") to show alongside it
+void timelineEnd(const char *category, const char *name, const char *args);
+
+#endif
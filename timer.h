@@ -0,0 +1,14 @@
+#ifndef clox_timer_h
+#define clox_timer_h
+
+#include <stdint.h>
+
+// Nanoseconds on the monotonic clock, counted from an arbitrary starting point.
+// Unlike "clock()" this is wall time and is not affected by clock adjustments
+uint64_t monotonicNanos();
+// Current value of the CPU's cycle counter (the time stamp counter on x86-64,
+// the virtual counter on AArch64), or "monotonicNanos()" where there is none.
+// Only differences between two readings on the same CPU are meaningful
+uint64_t cycleCounter();
+
+#endif
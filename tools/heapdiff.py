@@ -0,0 +1,214 @@
+#!/usr/bin/env python3
+"""Compare two clox heap snapshots by object type and retaining path.
+
+Snapshots are written by the "heapSnapshot(path)" native or by sending SIGUSR2
+to a running clox. Every object is attributed to the shortest chain of
+references from a root (a global, a call frame, a stack slot or an open
+upvalue) that reaches it, and objects are grouped by their type and that path.
+Objects that no root reaches (clox collects its garbage before writing a
+snapshot, so there should be none) are left out of the totals. The report lists
+the groups whose size changed the most between the two snapshots, which is
+usually what is holding on to the memory:
+
+    python3 tools/heapdiff.py before.heapsnapshot after.heapsnapshot
+
+Given a single snapshot it lists the largest groups instead.
+"""
+
+import argparse
+import collections
+import sys
+
+HEADER = "clox-heap-snapshot 1"
+
+# Types whose label (the function's name) is worth showing in a path
+NAMED_TYPES = {"closure", "function", "native"}
+
+# Longest run of repeated steps folded away, e.g. the cells of a linked list
+# made of closures repeat the same two steps
+MAX_CYCLE = 4
+
+
+class Snapshot:
+    """The objects, references and roots read from one snapshot file."""
+
+    def __init__(self, path):
+        self.objects = {}
+        self.edges = collections.defaultdict(list)
+        self.roots = []
+        with open(path, encoding="utf-8", errors="replace") as lines:
+            if lines.readline().rstrip("\n") != HEADER:
+                raise ValueError("%s is not a clox heap snapshot" % path)
+            for line in lines:
+                fields = line.rstrip("\n").split(" ", 4)
+                if fields[0] == "object":
+                    label = fields[4] if len(fields) > 4 else ""
+                    self.objects[fields[1]] = (fields[2], int(fields[3]),
+                                               label)
+                elif fields[0] == "edge":
+                    self.edges[fields[1]].append((fields[2], fields[3]))
+                elif fields[0] == "root":
+                    name = " ".join(fields[3:])
+                    self.roots.append((fields[2], "%s %s" % (fields[1], name)))
+
+    def step(self, edge, target):
+        """Describe following the reference "edge" to the object "target"."""
+        kind, _, label = self.objects[target]
+        if kind in NAMED_TYPES:
+            return "%s:%s %s" % (edge, kind, label)
+        return "%s:%s" % (edge, kind)
+
+    def retaining_paths(self):
+        """Map every reachable object to its shortest path from a root.
+
+        An object with several shortest paths gets the smallest of them, so
+        that the result doesn't depend on the order of the objects, roots and
+        references in the file, which changes with their addresses.
+        """
+        level = {}
+        for target, root in self.roots:
+            if target in self.objects:
+                path = (root,)
+                if target not in level or path < level[target]:
+                    level[target] = path
+
+        paths = {}
+        while level:
+            paths.update(level)
+            following = {}
+            for source, path in level.items():
+                for target, edge in self.edges[source]:
+                    if target in paths or target not in self.objects:
+                        continue
+                    candidate = fold(path + (self.step(edge, target),))
+                    if target not in following or \
+                            candidate < following[target]:
+                        following[target] = candidate
+            level = following
+        return paths
+
+    def groups(self):
+        """Count and total size of the reachable objects per (type, retaining
+        path), and of the unreachable ones."""
+        paths = self.retaining_paths()
+        totals = collections.defaultdict(lambda: [0, 0])
+        unreachable = [0, 0]
+        for address, (kind, size, _) in self.objects.items():
+            path = paths.get(address)
+            if path is None:
+                unreachable[0] += 1
+                unreachable[1] += size
+                continue
+            key = (kind, " > ".join(path))
+            totals[key][0] += 1
+            totals[key][1] += size
+        return totals, unreachable
+
+
+def fold(path):
+    """Drop a block of steps at the end of "path" that repeats the one before.
+
+    This gives every cell of a chain of objects the same path as the first.
+    """
+    for length in range(1, MAX_CYCLE + 1):
+        if len(path) > 2 * length and \
+                path[-length:] == path[-2 * length:-length]:
+            return path[:-length]
+    return path
+
+
+def format_size(size):
+    for unit in ["B", "KiB", "MiB"]:
+        if abs(size) < 1024:
+            return "%d %s" % (size, unit) if unit == "B" else \
+                "%.1f %s" % (size, unit)
+        size /= 1024
+    return "%.1f GiB" % size
+
+
+def print_unreachable(unreachable, out):
+    count, size = unreachable
+    if count > 0:
+        out.write("\n(%d unreachable objects, %s, left out)\n" %
+                  (count, format_size(size)))
+
+
+def print_summary(groups, limit, out):
+    """List the largest groups of a single snapshot."""
+    by_type = collections.defaultdict(lambda: [0, 0])
+    for (kind, _), (count, size) in groups.items():
+        by_type[kind][0] += count
+        by_type[kind][1] += size
+
+    out.write("%-10s %10s %12s\n" % ("type", "objects", "bytes"))
+    for kind, (count, size) in sorted(by_type.items(),
+                                      key=lambda item: -item[1][1]):
+        out.write("%-10s %10d %12s\n" % (kind, count, format_size(size)))
+
+    out.write("\n%10s %12s  %-8s %s\n" % ("objects", "bytes", "type", "path"))
+    largest = sorted(groups.items(), key=lambda item: -item[1][1])
+    for (kind, path), (count, size) in largest[:limit]:
+        out.write("%10d %12s  %-8s %s\n" % (count, format_size(size), kind,
+                                            path))
+
+
+def print_diff(before, after, limit, out):
+    """List the groups whose size changed the most between two snapshots."""
+    by_type = collections.defaultdict(lambda: [0, 0, 0, 0])
+    changes = []
+    for key in set(before) | set(after):
+        old_count, old_size = before.get(key, (0, 0))
+        new_count, new_size = after.get(key, (0, 0))
+        totals = by_type[key[0]]
+        totals[0] += old_count
+        totals[1] += new_count
+        totals[2] += old_size
+        totals[3] += new_size
+        if (old_count, old_size) != (new_count, new_size):
+            changes.append((key, new_count - old_count, new_size - old_size,
+                            new_size))
+
+    out.write("%-10s %10s %10s %12s %12s\n" %
+              ("type", "objects", "change", "bytes", "change"))
+    for kind, (old_count, new_count, old_size, new_size) in sorted(
+            by_type.items(), key=lambda item: -abs(item[1][3] - item[1][2])):
+        out.write("%-10s %10d %+10d %12s %12s\n" %
+                  (kind, new_count, new_count - old_count,
+                   format_size(new_size), "%+d" % (new_size - old_size)))
+
+    out.write("\n%10s %12s %12s  %-8s %s\n" %
+              ("objects", "bytes", "now", "type", "path"))
+    changes.sort(key=lambda change: -abs(change[2]))
+    for (kind, path), count, size, total in changes[:limit]:
+        out.write("%+10d %+12d %12s  %-8s %s\n" %
+                  (count, size, format_size(total), kind, path))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("snapshots", nargs="+", metavar="snapshot",
+                        help="one snapshot to summarise, or the earlier and "
+                        "the later of two to compare")
+    parser.add_argument("-n", "--limit", type=int, default=20,
+                        help="retaining paths to list (default: 20)")
+    args = parser.parse_args()
+
+    if len(args.snapshots) > 2:
+        parser.error("expected one or two snapshots")
+
+    try:
+        groups = [Snapshot(path).groups() for path in args.snapshots]
+    except (OSError, ValueError) as error:
+        sys.stderr.write("%s\n" % error)
+        return 1
+
+    if len(groups) == 1:
+        print_summary(groups[0][0], args.limit, sys.stdout)
+    else:
+        print_diff(groups[0][0], groups[1][0], args.limit, sys.stdout)
+    print_unreachable(groups[-1][1], sys.stdout)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
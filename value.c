@@ -32,6 +32,16 @@ void freeValueArray(ValueArray *array) {
 }
 
 void printValue(Value value) {
+#ifdef NAN_BOXING
+  if (IS_BOOL(value))
+    printf(AS_BOOL(value) ? "true" : "false");
+  else if (IS_NIL(value))
+    printf("nil");
+  else if (IS_NUMBER(value))
+    printf("%g", AS_NUMBER(value));
+  else if (IS_OBJ(value))
+    printObject(value);
+#else
   switch (value.type) {
   case VAL_BOOL:
     printf(AS_BOOL(value) ? "true" : "false");
@@ -46,9 +56,17 @@ void printValue(Value value) {
     printObject(value);
     break;
   }
+#endif
 }
 
 bool valuesEqual(Value a, Value b) {
+#ifdef NAN_BOXING
+  // Compare numbers as doubles so that NaN is not equal to itself
+  if (IS_NUMBER(a) && IS_NUMBER(b))
+    return AS_NUMBER(a) == AS_NUMBER(b);
+  // Everything else is equal only if it's the same bits
+  return a == b;
+#else
   // Checks equality of types too because we don't want another JS
   if (a.type != b.type)
     return false;
@@ -65,4 +83,5 @@ bool valuesEqual(Value a, Value b) {
   default:
     return false; // Unreachable
   }
+#endif
 }
\ No newline at end of file
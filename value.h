@@ -12,6 +12,61 @@ typedef struct ObjString ObjString;
 
 // End Forward Declarations
 
+#ifdef NAN_BOXING
+
+#include <string.h>
+
+/* Every value is a 64 bit double. Anything that isn't a number is hidden in
+   the payload of a quiet NaN, which no arithmetic produces:
+        - nil, false and true are quiet NaNs with 1, 2 or 3 in the low bits
+        - an object is a quiet NaN with the sign bit set and the pointer in the
+   low 48 bits
+ */
+typedef uint64_t Value;
+
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN ((uint64_t)0x7ffc000000000000)
+
+#define TAG_NIL 1   // 01
+#define TAG_FALSE 2 // 10
+#define TAG_TRUE 3  // 11
+
+// Type check macros
+
+#define IS_BOOL(value) (((value) | 1) == TRUE_VAL)
+#define IS_NIL(value) ((value) == NIL_VAL)
+#define IS_NUMBER(value) (((value) & QNAN) != QNAN)
+#define IS_OBJ(value) (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+// Conversion macros
+
+#define AS_OBJ(value) ((Obj *)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+#define AS_BOOL(value) ((value) == TRUE_VAL)
+#define AS_NUMBER(value) valueToNum(value)
+
+#define BOOL_VAL(b) ((b) ? TRUE_VAL : FALSE_VAL)
+#define FALSE_VAL ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL ((Value)(uint64_t)(QNAN | TAG_TRUE))
+#define NIL_VAL ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define NUMBER_VAL(num) numToValue(num)
+#define OBJ_VAL(obj) (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
+
+// Reinterpret the bits of "value" as a double, which compiles to nothing
+static inline double valueToNum(Value value) {
+  double num;
+  memcpy(&num, &value, sizeof(Value));
+  return num;
+}
+
+// Reinterpret the bits of "num" as a "Value"
+static inline Value numToValue(double num) {
+  Value value;
+  memcpy(&value, &num, sizeof(double));
+  return value;
+}
+
+#else
+
 // All of Lox's data types
 typedef enum {
   VAL_BOOL,
@@ -48,6 +103,8 @@ typedef struct {
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
 #define OBJ_VAL(object) ((Value){VAL_OBJ, {.obj = (Obj *)object}})
 
+#endif
+
 /* Struct containing array of constant Values with:
         - "count" as the index of the next "Value" to be added
         - "capacity" as the allocated size of the array
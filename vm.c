@@ -1,38 +1,248 @@
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+#include "callprofile.h"
 #include "chunk.h"
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "gcstats.h"
+#include "heapsnapshot.h"
 #include "memory.h"
 #include "object.h"
+#include "opstats.h"
+#include "perfcounters.h"
+#include "probes.h"
+#include "profiler.h"
+#include "timeline.h"
+#include "timer.h"
 #include "vm.h"
 
 VM vm;
 
+// Readings taken by "initVM()" that "nanoTime()" and "cycles()" count from, so
+// that the numbers they return stay small enough to be exact in a double
+static uint64_t startNanos;
+static uint64_t startCycles;
+
+// Set by a native function that failed with a runtime error, along with the
+// message to report, so that the safepoint after its call stops the program.
+// The message is empty if the error has already been reported by a call the
+// native made back into Lox
+static bool nativeFailed = false;
+static char nativeErrorMessage[256];
+
+static InterpretResult runNested(int baseFrame);
+static bool callValue(Value callee, int argCount);
+static void runtimeError(const char *format, ...);
+
+// Name of "function" as shown in backtraces and probes
+static inline const char *functionName(ObjFunction *function) {
+  return function->name != NULL ? function->name->chars : "script";
+}
+
+// Make the native function being called fail with a runtime error. The error
+// is reported by the safepoint that follows every call, so that calling a
+// native costs nothing extra when it succeeds
+static Value nativeError(const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  vsnprintf(nativeErrorMessage, sizeof(nativeErrorMessage), format, args);
+  va_end(args);
+  nativeFailed = true;
+  __atomic_store_n(&vm.safepointRequested, 1, __ATOMIC_RELAXED);
+  return NIL_VAL;
+}
+
+// Call "callee" without arguments from inside a native function and run it to
+// completion, storing its return value in "result". Returns false if the call
+// raised a runtime error, which has already been reported
+static bool callFromNative(Value callee, Value *result) {
+  int baseFrame = vm.frameCount;
+  Value *base = vm.stackTop;
+  push(callee);
+  if (callValue(callee, 0) && !nativeFailed &&
+      // Natives leave their result on the stack straight away
+      (vm.frameCount == baseFrame || runNested(baseFrame) == INTERPRET_OK)) {
+    *result = pop();
+    return true;
+  }
+
+  if (nativeFailed && nativeErrorMessage[0] != '\0')
+    runtimeError("%s", nativeErrorMessage);
+  // Drop what the failed call left behind, so that the native calling it can
+  // return normally. The stack is reset once the error reaches "interpret()"
+  vm.frameCount = baseFrame;
+  vm.stackTop = base;
+  nativeErrorMessage[0] = '\0';
+  nativeFailed = true;
+  __atomic_store_n(&vm.safepointRequested, 1, __ATOMIC_RELAXED);
+  return false;
+}
+
+static int compareSamples(const void *a, const void *b) {
+  uint64_t left = *(const uint64_t *)a;
+  uint64_t right = *(const uint64_t *)b;
+  return (left > right) - (left < right);
+}
+
+// Process CPU time in seconds, at whatever resolution "clock()" offers
 static Value clockNative(int argCount, Value *args) {
   return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
 }
 
+// Monotonic wall time in nanoseconds since the VM was initialised
+static Value nanoTimeNative(int argCount, Value *args) {
+  return NUMBER_VAL((double)(monotonicNanos() - startNanos));
+}
+
+// CPU cycle counter ticks since the VM was initialised (see "cycleCounter()")
+static Value cyclesNative(int argCount, Value *args) {
+  return NUMBER_VAL((double)(cycleCounter() - startCycles));
+}
+
+/* gcStats(name)
+   Returns the garbage collector statistic called "name" (see "gcStat()"), or
+   prints every statistic when called without arguments
+ */
+static Value gcStatsNative(int argCount, Value *args) {
+  if (argCount == 0) {
+    printGCStats(stdout);
+    return NIL_VAL;
+  }
+
+  double value;
+  if (argCount != 1 || !IS_STRING(args[0]))
+    return nativeError("gcStats() expects the name of a statistic");
+  if (!gcStat(AS_CSTRING(args[0]), &value))
+    return nativeError("Unknown GC statistic '%s'", AS_CSTRING(args[0]));
+  return NUMBER_VAL(value);
+}
+
+/* heapSnapshot(path)
+   Writes a snapshot of every object on the heap, the references between them
+   and the roots that keep them alive to "path" (see "writeHeapSnapshot()")
+ */
+static Value heapSnapshotNative(int argCount, Value *args) {
+  if (argCount != 1 || !IS_STRING(args[0]))
+    return nativeError("heapSnapshot() expects a file path");
+  if (!writeHeapSnapshot(AS_CSTRING(args[0])))
+    return nativeError("Couldn't write heap snapshot '%s'",
+                       AS_CSTRING(args[0]));
+  return NIL_VAL;
+}
+
+/* benchmark(function, iterations = 100, warmup = iterations / 10)
+   Calls "function" without arguments "warmup" times, then times each of
+   "iterations" further calls and prints the median, mean, variance and range
+   of those samples, along with the share of the measured time that went into
+   garbage collection. Returns the median in nanoseconds
+ */
+static Value benchmarkNative(int argCount, Value *args) {
+  if (argCount < 1 || argCount > 3 ||
+      !(IS_CLOSURE(args[0]) || IS_NATIVE(args[0])))
+    return nativeError("benchmark() expects a function, then optionally the "
+                       "number of iterations and warmup calls");
+  for (int i = 1; i < argCount; i++)
+    if (!IS_NUMBER(args[i]) || AS_NUMBER(args[i]) < (i == 1 ? 1 : 0) ||
+        AS_NUMBER(args[i]) > 100000000)
+      return nativeError("benchmark() %s count must be a number between %d "
+                         "and 100000000",
+                         i == 1 ? "iteration" : "warmup", i == 1 ? 1 : 0);
+
+  Value callee = args[0];
+  int iterations = argCount > 1 ? (int)AS_NUMBER(args[1]) : 100;
+  int warmup = argCount > 2 ? (int)AS_NUMBER(args[2]) : iterations / 10;
+  const char *name = IS_CLOSURE(callee)
+                         ? functionName(AS_CLOSURE(callee)->function)
+                         : ((ObjNative *)AS_OBJ(callee))->name;
+
+  uint64_t *samples = malloc(sizeof(uint64_t) * iterations);
+  if (samples == NULL)
+    return nativeError("benchmark() could not allocate %d samples", iterations);
+
+  Value result;
+  for (int i = 0; i < warmup; i++)
+    if (!callFromNative(callee, &result))
+      goto failed;
+
+  uint64_t gcBefore = gcStats.pauseNanos;
+  uint64_t total = 0;
+  for (int i = 0; i < iterations; i++) {
+    uint64_t start = monotonicNanos();
+    if (!callFromNative(callee, &result))
+      goto failed;
+    samples[i] = monotonicNanos() - start;
+    total += samples[i];
+  }
+  uint64_t gcNanos = gcStats.pauseNanos - gcBefore;
+
+  qsort(samples, iterations, sizeof(uint64_t), compareSamples);
+  double median = iterations % 2 == 1
+                      ? (double)samples[iterations / 2]
+                      : (samples[iterations / 2 - 1] + samples[iterations / 2]) /
+                            2.0;
+  double mean = (double)total / iterations;
+  double variance = 0;
+  for (int i = 0; i < iterations; i++)
+    variance += (samples[i] - mean) * (samples[i] - mean);
+  if (iterations > 1)
+    variance /= iterations - 1;
+
+  printf("benchmark %s: %d iterations after %d warmup\n", name, iterations,
+         warmup);
+  printf("  median   %14.0f ns\n", median);
+  printf("  mean     %14.0f ns\n", mean);
+  printf("  variance %14.0f ns^2\n", variance);
+  printf("  min      %14llu ns\n", (unsigned long long)samples[0]);
+  printf("  max      %14llu ns\n", (unsigned long long)samples[iterations - 1]);
+  printf("  gc       %14llu ns (%.1f%% of the measured time)\n",
+         (unsigned long long)gcNanos, total > 0 ? 100.0 * gcNanos / total : 0.0);
+
+  free(samples);
+  return NUMBER_VAL(median);
+
+failed:
+  // The error has been reported by "callFromNative()", which also made this
+  // call fail
+  free(samples);
+  return NIL_VAL;
+}
+
 // Set top of stack as beginning of stack and set the current call frame as the
 // outermost one
 static void resetStack() {
+#ifdef PROFILE_CALLS
+  // Close the span of the top level call that the error interrupted
+  if (timelineEnabled && vm.frameCount > 1)
+    timelineEnd("call", vm.frames[1].closure->function->name->chars, NULL);
+#endif
+
   vm.stackTop = vm.stack;
   vm.frameCount = 0;
   vm.openUpvalues = NULL;
+
+#ifdef PROFILE_CALLS
+  if (callProfilingEnabled)
+    profileUnwind();
+#endif
 }
 
-// Print formatted error with line number to STDERR
+// Print formatted error with line number to STDERR. The stack is reset by
+// "interpret()" once the error has made its way out of "run()"
 static void runtimeError(const char *format, ...) {
+  // Format into a buffer first so the message can be passed to the probe
+  char message[256];
   va_list args;
   va_start(args, format);
-  vfprintf(stderr, format, args);
+  vsnprintf(message, sizeof(message), format, args);
   va_end(args);
-  fputs("\n", stderr);
+  fprintf(stderr, "%s\n", message);
+  PROBE1(runtime__error, message);
 
   for (int i = vm.frameCount - 1; i >= 0; i--) {
     CallFrame *frame = &vm.frames[i];
@@ -46,13 +256,31 @@ static void runtimeError(const char *format, ...) {
     else
       fprintf(stderr, "%s()\n", function->name->chars);
   }
+}
 
-  resetStack();
+// Write barrier for "vm.globals" (see "writeBarrier()"). The generational
+// collector remembers the table as a whole rather than per entry, the
+// incremental one marks what is stored in it since the table is only scanned
+// when a cycle starts
+static inline void globalsBarrier(ObjString *name, Value value) {
+  // Neither applies to a full collection between cycles, so don't look up any
+  // mark bits for them
+  if (gcConfig.mode != GC_GENERATIONAL && !vm.gcMarking)
+    return;
+  if (heapIsMarked(name) && (!IS_OBJ(value) || heapIsMarked(AS_OBJ(value))))
+    return;
+  if (gcConfig.mode == GC_GENERATIONAL)
+    vm.globalsRemembered = true;
+  else if (vm.gcMarking) {
+    markObject((Obj *)name);
+    markValue(value);
+  }
 }
 
 static void defineNative(const char *name, NativeFn function) {
   push(OBJ_VAL(copyString(name, (int)strlen(name))));
-  push(OBJ_VAL(newNative(function)));
+  push(OBJ_VAL(newNative(function, name)));
+  globalsBarrier(AS_STRING(vm.stack[0]), vm.stack[1]);
   tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
   pop();
   pop();
@@ -66,13 +294,39 @@ void initVM() {
   vm.grayCapacity = 0;
   vm.grayStack = NULL;
 
+  vm.bytesAllocated = 0;
+  vm.nextGC = gcConfig.threshold;
+  vm.nextFullGC = gcConfig.threshold;
+  if (gcConfig.mode == GC_GENERATIONAL && gcConfig.nurserySize < vm.nextGC)
+    vm.nextGC = gcConfig.nurserySize;
+
+  vm.firstOld = NULL;
+  vm.rememberedCount = 0;
+  vm.rememberedCapacity = 0;
+  vm.remembered = NULL;
+  vm.globalsRemembered = false;
+  vm.gcMarking = false;
+  vm.gcSliceRequested = false;
+  vm.compactRequested = false;
+  vm.heapExhausted = false;
+  vm.safepointRequested = 0;
+
+  startNanos = monotonicNanos();
+  startCycles = cycleCounter();
+
   initTable(&vm.globals);
   initTable(&vm.strings);
 
   defineNative("clock", clockNative);
+  defineNative("nanoTime", nanoTimeNative);
+  defineNative("cycles", cyclesNative);
+  defineNative("benchmark", benchmarkNative);
+  defineNative("gcStats", gcStatsNative);
+  defineNative("heapSnapshot", heapSnapshotNative);
 }
 
 void freeVM() {
+  writeGCStatsReport();
   freeTable(&vm.globals);
   freeTable(&vm.strings);
   freeObjects();
@@ -108,6 +362,17 @@ static bool call(ObjClosure *closure, int argCount) {
   frame->ip = closure->function->chunk.code;
   frame->slots = vm.stackTop - argCount - 1;
 
+  PROBE2(function__entry, functionName(closure->function),
+         closure->function->chunk.lines[0]);
+
+#ifdef PROFILE_CALLS
+  if (callProfilingEnabled)
+    profileEnterFunction(closure->function);
+  // Only calls made from the top level of the script go on the timeline
+  if (timelineEnabled && vm.frameCount == 2)
+    timelineBegin("call", closure->function->name->chars);
+#endif
+
   return true;
 }
 
@@ -118,7 +383,22 @@ static bool callValue(Value callee, int argCount) {
       return call(AS_CLOSURE(callee), argCount);
     case OBJ_NATIVE: {
       NativeFn native = AS_NATIVE(callee);
+#ifdef PROFILE_CALLS
+      ObjNative *object = (ObjNative *)AS_OBJ(callee);
+      if (callProfilingEnabled)
+        profileEnterNative(object);
+      if (timelineEnabled && vm.frameCount == 1)
+        timelineBegin("call", object->name);
+#endif
+      PROBE2(function__entry, ((ObjNative *)AS_OBJ(callee))->name, 0);
       Value result = native(argCount, vm.stackTop - argCount);
+      PROBE1(function__return, ((ObjNative *)AS_OBJ(callee))->name);
+#ifdef PROFILE_CALLS
+      if (callProfilingEnabled)
+        profileReturn();
+      if (timelineEnabled && vm.frameCount == 1)
+        timelineEnd("call", object->name, NULL);
+#endif
       vm.stackTop -= argCount + 1;
       push(result);
       return true;
@@ -146,6 +426,8 @@ static ObjUpvalue *captureUpvalue(Value *local) {
     return upvalue;
 
   ObjUpvalue *createdUpvalue = newUpvalue(local);
+  // Keep the rest of the list (sorted by stack slot) after the new upvalue
+  createdUpvalue->next = upvalue;
 
   if (prevUpvalue == NULL)
     vm.openUpvalues = createdUpvalue;
@@ -158,7 +440,7 @@ static ObjUpvalue *captureUpvalue(Value *local) {
 static void closeUpvalues(Value *last) {
   while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last) {
     ObjUpvalue *upvalue = vm.openUpvalues;
-    upvalue->closed = *upvalue->location;
+    writeClosedUpvalue(upvalue, *upvalue->location);
     upvalue->location = &upvalue->closed;
     vm.openUpvalues = upvalue->next;
   }
@@ -172,31 +454,95 @@ static bool isFalsey(Value value) {
   return IS_NIL(value) || (IS_BOOL(value) & !AS_BOOL(value));
 }
 
-// Pop last two strings off of stack, concatenate and then push the result
-static void concatenate() {
+// Report that the heap has reached "gcConfig.heapLimit" and unwind the stack
+static void heapLimitError() {
+  runtimeError("Out of memory: the heap has reached its limit of %zu bytes",
+               gcConfig.heapLimit);
+}
+
+// Pop last two strings off of stack, concatenate and then push the result.
+// Returns false if there is no room for it below the heap limit
+static bool concatenate() {
   // Last in, first out, so the first string will be the second one from the top
-  // of the stack
-  ObjString *b = AS_STRING(pop());
-  ObjString *a = AS_STRING(pop());
+  // of the stack. They stay on the stack until the result exists, because the
+  // allocations below can trigger a collection
+  ObjString *b = AS_STRING(peek(0));
+  ObjString *a = AS_STRING(peek(1));
 
   // Resulting length of concatenated string
   int length = a->length + b->length;
-  char *chars = ALLOCATE(char, length + 1);
-  // Copy "a" to "chars"
-  memcpy(chars, a->chars, a->length);
-  // Copy "b" to "chars" but with offset of the length of "a"
-  memcpy(chars + a->length, b->chars, b->length);
-  // Null terminator 🙄
-  chars[length] = '\0';
-
-  // Create string object without copying and just taking ownership instead
-  ObjString *result = takeString(chars, length);
+  if (!reserveHeap(sizeof(ObjString) + length + 1)) {
+    heapLimitError();
+    return false;
+  }
+  ObjString *result = allocateString(length);
+  // Copy "a" to the new string
+  memcpy(result->chars, a->chars, a->length);
+  // Copy "b" to the new string but with offset of the length of "a"
+  memcpy(result->chars + a->length, b->chars, b->length);
+
+  // Intern the string, which is ready to use as it is
+  result = takeString(result);
+  pop();
+  pop();
   push(OBJ_VAL(result));
+  return true;
+}
+
+// Handle the requests made through "vm.safepointRequested". Only called between
+// instructions, where the VM's state is consistent. Objects may only be moved
+// if "canMove", i.e. no native function up the C stack holds pointers to them.
+// Returns false if the program has to stop with the runtime error reported
+static bool safepoint(bool canMove) {
+  __atomic_store_n(&vm.safepointRequested, 0, __ATOMIC_RELAXED);
+
+  if (nativeFailed) {
+    nativeFailed = false;
+    if (nativeErrorMessage[0] != '\0')
+      runtimeError("%s", nativeErrorMessage);
+    nativeErrorMessage[0] = '\0';
+    return false;
+  }
+
+  if (vm.heapExhausted) {
+    vm.heapExhausted = false;
+    // A collection since may have made room again
+    if (vm.bytesAllocated > gcConfig.heapLimit) {
+      heapLimitError();
+      return false;
+    }
+  }
+
+  if (samplesPending > 0)
+    recordSample();
+  if (snapshotRequested)
+    writeRequestedSnapshot();
+  if (vm.compactRequested) {
+    if (canMove)
+      compactHeap();
+    else
+      // Try again once the native has returned
+      __atomic_store_n(&vm.safepointRequested, 1, __ATOMIC_RELAXED);
+  }
+  // The concurrent marking thread sets this when it is done
+  if (__atomic_load_n(&vm.gcSliceRequested, __ATOMIC_ACQUIRE))
+    collectGarbageSlice();
+  return true;
 }
 
-static InterpretResult run() {
+// Execute bytecode until the frame at depth "baseFrame" returns, leaving its
+// return value on top of the stack. Only ever called with a constant
+// "baseFrame" and inlined into "run()" and "runNested()", so that the top level
+// loop compares against a constant 0 and does nothing for re-entrancy
+static inline __attribute__((always_inline)) InterpretResult
+execute(int baseFrame) {
   CallFrame *frame = &vm.frames[vm.frameCount - 1];
 
+#ifdef PROFILE_OPSTATS
+  if (opstatsEnabled)
+    resumeOpstats();
+#endif
+
 #define READ_BYTE() (*frame->ip++)
 #define READ_SHORT()                                                           \
   (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
@@ -221,22 +567,27 @@ static InterpretResult run() {
 
   for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
-    printf("          ");
-    // Print all values in stack
-    for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
-      printf("[ ");
-      printValue(*slot);
-      printf(" ]");
+    if (debugFlags.traceExecution) {
+      printf("          ");
+      // Print all values in stack
+      for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
+        printf("[ ");
+        printValue(*slot);
+        printf(" ]");
+      }
+      printf("\n");
+      // Disassemble and display each instruction before execution
+      disassembleInstruction(
+          &frame->closure->function->chunk,
+          (int)(frame->ip - frame->closure->function->chunk.code));
     }
-    printf("\n");
-    // Disassemble and display each instruction before execution
-    disassembleInstruction(
-        &frame->closure->function->chunk,
-        (int)(frame->ip - frame->closure->function->chunk.code));
-
 #endif
-    uint8_t instruction;
-    switch (instruction = READ_BYTE()) {
+    uint8_t instruction = READ_BYTE();
+#ifdef PROFILE_OPSTATS
+    if (opstatsEnabled)
+      recordInstruction(instruction);
+#endif
+    switch (instruction) {
     case OP_CONSTANT: {
       Value constant = READ_CONSTANT();
       push(constant);
@@ -277,12 +628,14 @@ static InterpretResult run() {
     }
     case OP_DEFINE_GLOBAL: {
       ObjString *name = READ_STRING();
+      globalsBarrier(name, peek(0));
       tableSet(&vm.globals, name, peek(0));
       pop();
       break;
     }
     case OP_SET_GLOBAL: {
       ObjString *name = READ_STRING();
+      globalsBarrier(name, peek(0));
       if (tableSet(&vm.globals, name, peek(0))) {
         tableDelete(&vm.globals, name);
         runtimeError("Undefined variable '%s'", name->chars);
@@ -297,7 +650,12 @@ static InterpretResult run() {
     }
     case OP_SET_UPVALUE: {
       uint8_t slot = READ_BYTE();
-      *frame->closure->upvalues[slot]->location = peek(0);
+      ObjUpvalue *upvalue = frame->closure->upvalues[slot];
+      // Only a closed upvalue holds the value itself
+      if (upvalue->location == &upvalue->closed)
+        writeClosedUpvalue(upvalue, peek(0));
+      else
+        *upvalue->location = peek(0);
       break;
     }
     case OP_EQUAL: {
@@ -314,9 +672,10 @@ static InterpretResult run() {
       BINARY_OP(BOOL_VAL, <);
       break;
     case OP_ADD:
-      if (IS_STRING(peek(0)) && IS_STRING(peek(1)))
-        concatenate();
-      else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+      if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+        if (!concatenate())
+          return INTERPRET_RUNTIME_ERROR;
+      } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
         double b = AS_NUMBER(pop());
         double a = AS_NUMBER(pop());
         push(NUMBER_VAL(a + b));
@@ -374,6 +733,11 @@ static InterpretResult run() {
     case OP_LOOP: {
       // Number of bytes to jump backwards by
       uint16_t offset = READ_SHORT();
+      // Before jumping, so that an error is reported on the loop's line rather
+      // than on the one before the loop
+      if (__atomic_load_n(&vm.safepointRequested, __ATOMIC_RELAXED) &&
+          !safepoint(baseFrame == 0))
+        return INTERPRET_RUNTIME_ERROR;
       // Jump backwards
       frame->ip -= offset;
       break;
@@ -383,6 +747,9 @@ static InterpretResult run() {
       if (!callValue(peek(argCount), argCount))
         return INTERPRET_RUNTIME_ERROR;
       frame = &vm.frames[vm.frameCount - 1];
+      if (__atomic_load_n(&vm.safepointRequested, __ATOMIC_RELAXED) &&
+          !safepoint(baseFrame == 0))
+        return INTERPRET_RUNTIME_ERROR;
       break;
     }
     case OP_CLOSURE: {
@@ -392,10 +759,12 @@ static InterpretResult run() {
       for (int i = 0; i < closure->upvalueCount; i++) {
         uint8_t isLocal = READ_BYTE();
         uint8_t index = READ_BYTE();
+        // Capturing can trigger a collection that makes "closure" old
         if (isLocal)
           closure->upvalues[i] = captureUpvalue(frame->slots + index);
         else
           closure->upvalues[i] = frame->closure->upvalues[index];
+        writeBarrier((Obj *)closure, OBJ_VAL(closure->upvalues[i]));
       }
       break;
     }
@@ -407,14 +776,20 @@ static InterpretResult run() {
     case OP_RETURN: {
       Value result = pop();
       closeUpvalues(frame->slots);
+      PROBE1(function__return, functionName(frame->closure->function));
+#ifdef PROFILE_CALLS
+      if (callProfilingEnabled)
+        profileReturn();
+#endif
       vm.frameCount--;
-      if (vm.frameCount == 0) {
-        pop();
-        return INTERPRET_OK;
-      }
-
+#ifdef PROFILE_CALLS
+      if (timelineEnabled && vm.frameCount == 1)
+        timelineEnd("call", frame->closure->function->name->chars, NULL);
+#endif
       vm.stackTop = frame->slots;
       push(result);
+      if (vm.frameCount == baseFrame)
+        return INTERPRET_OK;
 
       frame = &vm.frames[vm.frameCount - 1];
       break;
@@ -429,9 +804,20 @@ static InterpretResult run() {
 #undef BINARY_OP
 }
 
+// Run the script until it returns
+static InterpretResult run() { return execute(0); }
+
+// Run a call made by a native function (see "callFromNative()") until it
+// returns to the native at frame depth "baseFrame"
+static InterpretResult runNested(int baseFrame) { return execute(baseFrame); }
+
 InterpretResult interpret(const char *source) {
   // Compile source as function instead of chunk
+  if (perfCountersEnabled)
+    perfPhaseBegin(PERF_COMPILE);
   ObjFunction *function = compile(source);
+  if (perfCountersEnabled)
+    perfPhaseEnd();
   if (function == NULL)
     return INTERPRET_COMPILE_ERROR;
 
@@ -441,5 +827,20 @@ InterpretResult interpret(const char *source) {
   push(OBJ_VAL(closure));
   callValue(OBJ_VAL(closure), 0);
 
-  return run();
+  if (timelineEnabled)
+    timelineBegin("execute", "run");
+  if (perfCountersEnabled)
+    perfPhaseBegin(PERF_RUN);
+
+  InterpretResult result = run();
+  if (result == INTERPRET_OK)
+    pop(); // The script's return value
+  else
+    resetStack();
+
+  if (perfCountersEnabled)
+    perfPhaseEnd();
+  if (timelineEnabled)
+    timelineEnd("execute", "run", NULL);
+  return result;
 }
@@ -1,6 +1,8 @@
 #ifndef clox_vm_h
 #define clox_vm_h
 
+#include <signal.h>
+
 #include "chunk.h"
 #include "object.h"
 #include "table.h"
@@ -31,6 +33,27 @@ typedef struct {
          - "openUpvalues" is a linked list of all open upvalues to deduplicate
    upvalues
          - "objects" is a linked list of references to objects
+         - "bytesAllocated" is the number of bytes the VM currently has
+   allocated, including the gray stack
+         - "nextGC" is the value of "bytesAllocated" that triggers the next
+   collection
+         - "firstOld" is the first old object in "objects" in generational mode;
+   every object before it is young
+         - "nextFullGC" is the value of "bytesAllocated" above which the next
+   collection in generational mode is a full one
+         - "remembered" holds the old objects that may refer to young ones
+         - "globalsRemembered" is set when a young object may have been stored
+   in "globals"
+         - "gcMarking" is set while incremental marking is in progress, and
+   "gcSliceRequested" when the next safepoint should run a slice of it
+         - "compactRequested" is set when the next safepoint without a native
+   function on the C stack should compact the heap
+         - "heapExhausted" is set when the heap has outgrown
+   "gcConfig.heapLimit" even after collecting, and the next safepoint should
+   stop the program with an out of memory error
+         - "safepointRequested" is set (e.g. from a signal handler) to make
+   "run()" stop at its next safepoint (a call or loop) and handle whatever
+   was asked for
  */
 typedef struct {
   CallFrame frames[FRAMES_MAX];
@@ -46,6 +69,21 @@ typedef struct {
   int grayCount;
   int grayCapacity;
   Obj **grayStack;
+  size_t bytesAllocated;
+  size_t nextGC;
+
+  Obj *firstOld;
+  size_t nextFullGC;
+  int rememberedCount;
+  int rememberedCapacity;
+  Obj **remembered;
+  bool globalsRemembered;
+  bool gcMarking;
+  bool gcSliceRequested;
+  bool compactRequested;
+  bool heapExhausted;
+
+  volatile sig_atomic_t safepointRequested;
 } VM;
 
 typedef enum {